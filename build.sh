@@ -12,8 +12,12 @@ elif (test "$1" = "static"); then
 	echo ":: Build termbox.o for static linking"
 	rm -f termbox.o || exit 1
 	${CC} -O3 -fPIC -c -o termbox.o -DTB_IMPL -DTB_LIB_OPTS -I. termbox-static.h || exit 1
+elif (test "$1" = "bench"); then
+	echo ":: Build tests/bench for microbenchmarks"
+	rm -f tests/bench || exit 1
+	${CC} -O3 -pthread -o tests/bench -DTB_LIB_OPTS -I. tests/bench.c || exit 1
 else
-	echo "Usage: ./setup.sh [shared | static]"
+	echo "Usage: ./setup.sh [shared | static | bench]"
 	echo "Example: ./setup.sh shared"
 	
 	exit 1
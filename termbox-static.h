@@ -39,6 +39,7 @@ SOFTWARE.
 #include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,9 +50,19 @@ SOFTWARE.
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
+// Diff threads take the same locks as the render thread
+#if defined(TB_OPT_DIFF_THREADS) && !defined(TB_OPT_RENDER_THREAD)
+#define TB_OPT_RENDER_THREAD
+#endif
+
+#ifdef TB_OPT_RENDER_THREAD
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -194,6 +205,11 @@ extern "C" {
 /* Some hard-coded caps */
 #define TB_HARDCAP_ENTER_MOUSE  "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define TB_HARDCAP_EXIT_MOUSE   "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
+#define TB_HARDCAP_RESET_SCROLL_REGION "\x1b[r"
+#define TB_HARDCAP_REVERSE_INDEX       "\x1bM"
+#define TB_HARDCAP_BEGIN_SYNC          "\x1b[?2026h"
+#define TB_HARDCAP_END_SYNC            "\x1b[?2026l"
+#define TB_HARDCAP_QUERY_SYNC          "\x1b[?2026$p"
 
 /* Colors (numeric) and attributes (bitwise) (tb_cell.fg, tb_cell.bg) */
 #define TB_BLACK                0x0001
@@ -246,6 +262,25 @@ extern "C" {
 #define TB_OUTPUT_TRUECOLOR 5
 #endif
 
+/* Present modes (bitwise) (tb_set_present_mode) */
+#define TB_PRESENT_CURRENT  0
+#define TB_PRESENT_NORMAL   1
+#define TB_PRESENT_SCROLL   2
+#define TB_PRESENT_REPAINT  4
+#define TB_PRESENT_REDRAW   8
+
+/* Synchronized output modes (tb_set_sync_mode) */
+#define TB_SYNC_CURRENT     0
+#define TB_SYNC_AUTO        1
+#define TB_SYNC_ON          2
+#define TB_SYNC_OFF         3
+
+/* Flush modes (tb_set_flush_mode) */
+#define TB_FLUSH_CURRENT    0
+#define TB_FLUSH_BLOCKING   1
+#define TB_FLUSH_APPEND     2
+#define TB_FLUSH_COALESCE   3
+
 /* Common function return values unless otherwise noted.
  *
  * Library behavior is undefined after receiving TB_ERR_MEM. Callers may
@@ -275,6 +310,7 @@ extern "C" {
 #define TB_ERR_RESIZE_READ      -20
 #define TB_ERR_RESIZE_SSCANF    -21
 #define TB_ERR_CAP_COLLISION    -22
+#define TB_ERR_WOULD_BLOCK      -23
 
 #define TB_ERR_SELECT           TB_ERR_POLL
 #define TB_ERR_RESIZE_SELECT    TB_ERR_RESIZE_POLL
@@ -324,7 +360,8 @@ typedef uint16_t uintattr_t;
  * however some support for grapheme clusters (e.g., combining diacritical
  * marks) and wide code points (e.g., Hiragana) is provided through ech, nech,
  * cech via tb_set_cell_ex(). ech is only valid when nech>0, otherwise ch is
- * used.
+ * used. Cells holding the same cluster point to the same read-only ech, owned
+ * by termbox.
  *
  * For non-single-width code points, given N=wcwidth(ch)/wcswidth(ech):
  *
@@ -345,9 +382,9 @@ struct tb_cell {
     uintattr_t fg; /* bitwise foreground attributes */
     uintattr_t bg; /* bitwise background attributes */
 #ifdef TB_OPT_EGC
-    uint32_t *ech; /* a grapheme cluster of Unicode code points */
+    uint32_t *ech; /* a grapheme cluster of Unicode code points, shared */
     size_t nech;   /* length in bytes of ech, 0 means use ch instead of ech */
-    size_t cech;   /* capacity in bytes of ech */
+    size_t cech;   /* unused, always 0 */
 #endif
 };
 
@@ -375,6 +412,35 @@ struct tb_event {
     int32_t y;    /* mouse y */
 };
 
+/* Statistics about the most recent tb_present() call. See tb_get_stats(). */
+struct tb_stats {
+    size_t bytes;            /* bytes written to the tty */
+    size_t cells;            /* cells sent */
+    size_t cursor_moves;     /* cursor motions sent */
+    size_t cursor_bytes;     /* bytes spent on cursor motion */
+    size_t sgr_cache_hits;   /* attribute changes sent from the cache */
+    size_t sgr_cache_misses; /* attribute changes encoded from scratch */
+    int synchronized;        /* 1 if wrapped in synchronized output */
+    int repainted;           /* 1 if the screen was cleared and redrawn */
+    int deferred;            /* 1 if held back by output pending or pacing */
+    size_t pending;          /* bytes not yet written to the tty */
+    size_t frames_merged;    /* frames held back since tb_init() */
+    size_t frames_dropped;   /* held-back frames overwritten by a later one */
+    int rows_left;           /* changed rows left over the present budget */
+    size_t row_cache_hits;   /* rows sent from the row cache */
+    size_t row_cache_misses; /* whole rows encoded from scratch */
+    size_t row_cache_bytes;  /* memory held by the row cache */
+};
+
+/* Cost of the next frame, see tb_present_estimate() */
+struct tb_present_cost {
+    size_t bytes;        /* bytes that would be written to the tty */
+    size_t cells;        /* cells that would be sent */
+    size_t cursor_moves; /* cursor motions that would be sent */
+    size_t sgr_changes;  /* attribute changes that would be sent */
+    int rows_left;       /* changed rows that would be left over the budget */
+};
+
 /* Initializes the termbox library. This function should be called before any
  * other functions. tb_init() is equivalent to tb_init_file("/dev/tty"). After
  * successful initialization, the library must be finalized using the
@@ -401,10 +467,64 @@ int tb_height(void);
 int tb_clear(void);
 int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg);
 
-/* Synchronizes the internal back buffer with the terminal by writing to tty. */
+/* Synchronizes the internal back buffer with the terminal by writing to tty.
+ *
+ * Only the columns changed since the previous tb_present() are examined.
+ * Changes are tracked by tb_set_cell(), tb_set_cell_ex(), tb_extend_cell(),
+ * tb_clear(), and resizes. Calling tb_cell_buffer() marks the whole buffer as
+ * changed; callers that keep the returned pointer across presents must call
+ * tb_invalidate() after writing to it. With TB_OPT_EGC or TB_OPT_SOA, it
+ * returns a copy of the back buffer, which is taken in by the next present or
+ * tb_invalidate().
+ *
+ * Runs of identical cells are sent as erase-to-end-of-line, ECH or REP when
+ * the terminal's terminfo entry has el, ech or rep and that is shorter.
+ * Attribute changes between cells only send what differs from the previous
+ * cell when the terminal's attribute caps are the ECMA-48 SGR sequences.
+ */
 int tb_present(void);
 
-/* Sets the position of the cursor. Upper-left character is (0, 0). */
+/* Like tb_present(), but only sends changes inside the given rectangle, e.g.,
+ * the one pane that changed. Wide characters straddling its left or right
+ * edge are sent whole. Changes outside the rectangle stay pending for a later
+ * present. Scrolling and repainting (see tb_set_present_mode()) are only done
+ * by tb_present(). If the render thread is running, the whole frame is handed
+ * off as by tb_present().
+ *
+ * With tb_set_max_fps(), a region counts as a frame. One sent too soon after
+ * the previous frame holds back the whole frame as tb_present() would, and
+ * one sent while a frame is held back and due sends the whole frame.
+ *
+ * The rectangle is clipped to the screen. TB_ERR_OUT_OF_BOUNDS is returned if
+ * nothing is left of it.
+ */
+int tb_present_region(int x, int y, int w, int h);
+
+/* Fills cost with what tb_present() would send for the current back buffer,
+ * without sending anything or changing what the next tb_present() does. An
+ * app can use it to, e.g., drop detail from a frame that would take too long
+ * over a slow link. Output still pending from earlier frames and frames held
+ * back by tb_set_max_fps() aren't taken into account: the cost is that of the
+ * frame when it's sent.
+ *
+ * This encodes the frame like tb_present() does, so it costs about as much as
+ * a present minus the write.
+ */
+int tb_present_estimate(struct tb_present_cost *cost);
+
+/* Marks the entire internal back buffer as changed, forcing the next
+ * tb_present() to compare every cell against the terminal.
+ */
+int tb_invalidate(void);
+
+/* Fills stats with statistics about the most recent tb_present() call. */
+int tb_get_stats(struct tb_stats *stats);
+
+/* Sets the position of the cursor. Upper-left character is (0, 0).
+ *
+ * Like cursor motion in tb_present(), this uses the shortest sequence that
+ * gets there from the last known position, which is lost after tb_send().
+ */
 int tb_set_cursor(int cx, int cy);
 int tb_hide_cursor(void);
 
@@ -424,6 +544,30 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg);
 int tb_extend_cell(int x, int y, uint32_t ch);
 
+/* Sets ch, fg and bg to row y of the internal back buffer, which holds each
+ * field of its cells in a separate array when termbox is compiled with
+ * TB_OPT_SOA. Returns TB_ERR otherwise.
+ *
+ * The row is written directly, e.g., a whole row of colors at once, and marked
+ * as changed. The pointers stay valid until the next present, resize, or call
+ * to tb_cell_buffer(), tb_invalidate() or tb_extend_cell(); get the row again
+ * after any of these. With TB_OPT_EGC, a cell holding a grapheme cluster has
+ * its top bit set in ch, and copying its ch to another cell of these rows
+ * copies the cluster. Other values with the top bit set are taken as U+FFFD.
+ */
+int tb_cell_row(int y, uint32_t **ch, uintattr_t **fg, uintattr_t **bg);
+
+/* Copies a w by h rectangle of cells to the internal back buffer at x, y, as
+ * many calls to tb_set_cell_ex() would, e.g., a panel built in the caller's
+ * memory. Row r of the rectangle starts at src[r * src_stride]. With
+ * TB_OPT_EGC, a cell with nech > 0 sets the grapheme cluster in ech.
+ *
+ * The rectangle is clipped to the screen. TB_ERR_OUT_OF_BOUNDS is returned if
+ * nothing is left of it, and TB_ERR if src_stride is less than w.
+ */
+int tb_blit(int x, int y, int w, int h, const struct tb_cell *src,
+    int src_stride);
+
 /* Sets the input mode. Termbox has two input modes:
  *
  * 1. TB_INPUT_ESC
@@ -521,6 +665,192 @@ int tb_set_input_mode(int mode);
  */
 int tb_set_output_mode(int mode);
 
+/* Sets the present mode, i.e., which optimizations tb_present() may use when
+ * updating the terminal. TB_PRESENT_NORMAL is always on, and the following
+ * may be applied via bitwise OR operation:
+ *
+ * 1. TB_PRESENT_SCROLL
+ *    Detect blocks of rows that moved up or down since the last present (e.g.,
+ *    a scrolling log pane) and shift them on the terminal with a scroll region
+ *    instead of redrawing them. Only the newly exposed rows are then sent.
+ *    Requires the change_scroll_region (csr) capability.
+ *
+ * 2. TB_PRESENT_REPAINT
+ *    When most of the screen changed (e.g., a page flip), clear it and stream
+ *    every row from the top instead of updating changed cells one by one,
+ *    whichever is estimated to send fewer bytes. tb_get_stats() reports
+ *    which way each frame was sent.
+ *
+ * 3. TB_PRESENT_REDRAW
+ *    Declares that the caller redraws every cell before each tb_present(),
+ *    e.g., an immediate mode UI calling tb_clear() and drawing the whole
+ *    screen each frame. Instead of copying every cell sent into the front
+ *    buffer, a frame presented whole swaps the back and front buffers, so the
+ *    back buffer then holds an older frame until it is redrawn. The pointer
+ *    returned by tb_cell_buffer() may change on each present.
+ *
+ * Modes not supported by the terminal are dropped. If mode is
+ * TB_PRESENT_CURRENT, the function returns the current present mode, which can
+ * be used to check what took effect.
+ *
+ * The default present mode is TB_PRESENT_NORMAL.
+ */
+int tb_set_present_mode(int mode);
+
+/* Sets whether tb_present() wraps each frame in synchronized output (DEC
+ * private mode 2026), so the terminal renders the frame at once instead of
+ * repainting while it arrives. Available modes:
+ *
+ * 1. TB_SYNC_AUTO
+ *    Synchronize if the terminal supports it. tb_init() asks the terminal
+ *    (DECRQM) and its reply is read by tb_peek_event() and tb_poll_event(), so
+ *    frames are synchronized from the first event poll after the reply.
+ *
+ * 2. TB_SYNC_ON
+ *    Always synchronize. Terminals without support ignore the mode.
+ *
+ * 3. TB_SYNC_OFF
+ *    Never synchronize.
+ *
+ * If mode is TB_SYNC_CURRENT, the function returns the current sync mode. Use
+ * tb_get_stats() to check whether the last frame was synchronized.
+ *
+ * The default sync mode is TB_SYNC_AUTO.
+ */
+int tb_set_sync_mode(int mode);
+
+/* Sets how output is written to the terminal. Available modes:
+ *
+ * 1. TB_FLUSH_BLOCKING
+ *    tb_present() returns once the whole frame is written.
+ *
+ * 2. TB_FLUSH_APPEND
+ *    tb_present() writes as much as the terminal takes without blocking and
+ *    returns TB_ERR_WOULD_BLOCK if some of the frame is still pending. The
+ *    next frame is appended to what is pending.
+ *
+ * 3. TB_FLUSH_COALESCE
+ *    Like TB_FLUSH_APPEND, but while output is pending tb_present() only
+ *    tries to write it and leaves the new changes in the back buffer. They
+ *    are sent, merged, by the first tb_present() after the output drained.
+ *
+ * In the non-blocking modes, poll the fd from tb_get_pending() for writing
+ * and call tb_flush() or tb_present() when it's ready. The fd is put in
+ * non-blocking mode until TB_FLUSH_BLOCKING is set again or tb_shutdown().
+ * Functions other than tb_present() and tb_flush() still block until all
+ * output is written.
+ *
+ * If mode is TB_FLUSH_CURRENT, the function returns the current flush mode.
+ *
+ * The default flush mode is TB_FLUSH_BLOCKING.
+ */
+int tb_set_flush_mode(int mode);
+
+/* Writes pending output without blocking (unless in TB_FLUSH_BLOCKING mode).
+ * Returns TB_OK if everything was written, or TB_ERR_WOULD_BLOCK if some
+ * output is still pending.
+ */
+int tb_flush(void);
+
+/* Gets the fd termbox writes to and the number of bytes still pending. */
+int tb_get_pending(int *wfd, size_t *pending);
+
+/* Limits how often tb_present() sends a frame to at most fps per second.
+ * A tb_present() sooner than that after the previous frame sends nothing and
+ * holds the frame back. It's sent, together with any changes made in the
+ * meantime, once the interval is over: by tb_peek_event() or tb_poll_event(),
+ * which wake up for it, or by the next tb_present(). tb_get_stats() counts
+ * the frames merged this way and how many of them were never shown.
+ *
+ * If fps is 0, pacing is disabled and a held-back frame is sent right away.
+ * If fps is negative, the function returns the current limit. Pacing is
+ * disabled by default.
+ */
+int tb_set_max_fps(int fps);
+
+/* Returns the number of milliseconds until a held-back frame is due, 0 if it
+ * is due now, or -1 if no frame is held back. Useful when polling the fds
+ * from tb_get_fds() instead of calling tb_peek_event(); call tb_present()
+ * when it's due.
+ */
+int tb_frame_due_ms(void);
+
+/* Limits how many bytes tb_present() sends per frame, so a big redraw over a
+ * slow link doesn't hold up input echo behind it. Once the budget is spent,
+ * tb_present() stops before the next changed row and leaves it and the rest
+ * for later presents; tb_get_stats() reports how many rows are left. Each
+ * present sends at least one row, so repeated calls converge.
+ *
+ * The cells in the priority rect (see tb_set_priority_rect()) are sent first,
+ * or, if none is set, the rows around the cursor.
+ *
+ * If bytes is 0, frames are sent whole (the default). If bytes is negative,
+ * the function returns the current budget.
+ */
+int tb_set_present_budget(int bytes);
+
+/* Sets the area sent first when a frame is over the present budget. If w or
+ * h is 0, the rows around the cursor are sent first instead.
+ */
+int tb_set_priority_rect(int x, int y, int w, int h);
+
+/* Starts (enable=1) or stops (enable=0) a thread that presents frames in the
+ * background. tb_present() then copies the changed cells for the thread and
+ * returns without waiting for them to be compared and written, so a slow
+ * terminal doesn't hold up the caller. A frame handed off while the thread is
+ * still busy with the previous one waits for it, and is merged with the next
+ * one if that comes first. tb_present() returns errors from earlier frames.
+ *
+ * The cell functions (tb_set_cell(), tb_print(), tb_clear(), etc.) and
+ * tb_present() don't wait for the thread. Other functions that touch the
+ * terminal, such as tb_set_cursor(), tb_send(), tb_get_stats() or handling
+ * a resize event, first wait until the thread has presented every frame
+ * handed to it. Stopping the thread or tb_shutdown() also waits for that.
+ *
+ * If enable is negative, the function returns 1 if the thread is running.
+ * Requires termbox to be compiled with TB_OPT_RENDER_THREAD (and linked with
+ * -pthread), otherwise TB_ERR is returned.
+ */
+int tb_set_render_thread(int enable);
+
+/* Sets how many threads tb_present() uses to compare the back buffer with
+ * the terminal and encode the changes, counting the one calling it. Rows are
+ * split into a band per thread, each thread encoding its rows into output of
+ * its own, which is then joined in order. A row encoded from another cursor
+ * position or attributes than the rows before it leave is encoded again at
+ * the join, usually only the first changed row of each band, so the output
+ * is the same as with 1 thread (the default).
+ *
+ * This is experimental. It's meant for very large screens where much of the
+ * time goes into comparing and encoding rows, but isn't known to be faster
+ * yet; measure with the diff_threads case of tests/bench before relying on
+ * it.
+ *
+ * Rows aren't looked up in the row cache (see tb_set_row_cache()) while more
+ * than 1 thread is used, and with a present budget (see
+ * tb_set_present_budget()) frames are encoded by 1 thread.
+ *
+ * n is capped at TB_DIFF_THREADS_MAX. If n is negative, the function returns
+ * the current number of threads. Requires termbox to be compiled with
+ * TB_OPT_DIFF_THREADS (which implies TB_OPT_RENDER_THREAD), otherwise TB_ERR
+ * is returned.
+ */
+int tb_set_diff_threads(int n);
+
+/* Sets how much memory tb_present() may use to remember the bytes it sent for
+ * rows that changed whole. When a row changes from and to the same content
+ * again, e.g., when switching back and forth between two views, those bytes
+ * are sent instead of encoding the row again. Rows are matched on their old
+ * and new cells and the cursor position and attributes the terminal had
+ * before them, so the output is the same as without the cache. The least
+ * recently used rows are dropped to stay under the limit. tb_get_stats()
+ * reports hits, misses and the memory in use.
+ *
+ * If bytes is 0, the cache is emptied and disabled (the default). If bytes is
+ * negative, the function returns the current limit.
+ */
+int tb_set_row_cache(int bytes);
+
 /* Wait for an event up to timeout_ms milliseconds and fill the event structure
  * with it. If no event is available within the timeout period, TB_ERR_NO_EVENT
  * is returned. On a resize event, the underlying select(2) call may be
@@ -547,7 +877,9 @@ int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 int tb_printf_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
     const char *fmt, ...);
 
-/* Send raw bytes to terminal. */
+/* Send raw bytes to terminal. The cursor position and attributes termbox
+ * assumes the terminal has are forgotten, so the next cell sent resets them
+ * in full. */
 int tb_send(const char *buf, size_t nbuf);
 int tb_sendf(const char *fmt, ...);
 
@@ -583,6 +915,86 @@ const char *tb_version(void);
 
 #ifdef TB_IMPL
 
+/* Define TB_OPT_NO_SIMD to disable the SSE2/AVX2 kernels used by tb_present().
+ * Otherwise they are selected at runtime based on CPU support.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) &&         \
+    !defined(TB_OPT_NO_SIMD)
+#define TB_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Define TB_OPT_SOA to keep the ch, fg and bg of the cells of each cell buffer
+ * in separate arrays, see struct cellbuf_t. Cells can then be written a row
+ * at a time with tb_cell_row().
+ */
+
+/* Whether tb_cell_buffer() hands out a copy of the back buffer, see
+ * view_load() */
+#if defined(TB_OPT_EGC) || defined(TB_OPT_SOA)
+#define TB_CELL_VIEW
+#endif
+
+/* Front buffer marker for columns covered by the preceding wide cell */
+#define TB_SHADOW_CH 0xffffffff
+
+/* Optional terminal caps (bitwise) (global.opt_caps) */
+#define TB_OPTCAP_CSR  1 /* change_scroll_region */
+#define TB_OPTCAP_INDN 2 /* parm_index */
+#define TB_OPTCAP_RIN  4 /* parm_rindex */
+#define TB_OPTCAP_HPA  8 /* column_address */
+#define TB_OPTCAP_VPA 16 /* row_address */
+#define TB_OPTCAP_CUF 32 /* parm_right_cursor */
+#define TB_OPTCAP_CUB 64 /* parm_left_cursor */
+#define TB_OPTCAP_CUU 128 /* parm_up_cursor */
+#define TB_OPTCAP_CUD 256 /* parm_down_cursor */
+#define TB_OPTCAP_ECH 512 /* erase_chars */
+#define TB_OPTCAP_EL  1024 /* clr_eol */
+#define TB_OPTCAP_REP 2048 /* repeat_char */
+#define TB_OPTCAP_BCE 4096 /* back_color_erase (boolean) */
+#define TB_OPTCAP_ECMA_SGR 8192 /* attribute caps are plain ECMA-48 SGR */
+#define TB_OPTCAP_AM  16384 /* auto_right_margin (boolean) */
+
+/* Rendered attributes (bitwise) (struct sgr_t) */
+#define TB_SGR_BOLD       1
+#define TB_SGR_BLINK      2
+#define TB_SGR_UNDERLINE  4
+#define TB_SGR_ITALIC     8
+#define TB_SGR_REVERSE    16
+#define TB_SGR_FG_DEFAULT 32
+#define TB_SGR_BG_DEFAULT 64
+
+/* Longest parameter list of an SGR sequence built by send_attr() */
+#define TB_SGR_PARAMS_LEN 64
+
+/* Number of attribute changes remembered by send_attr() (power of 2) */
+#define TB_SGR_CACHE_SIZE 256
+
+/* Hash buckets of the row cache (power of 2), see tb_set_row_cache() */
+#define TB_ROW_CACHE_BUCKETS 1024
+
+/* Hash buckets of the grapheme cluster table (power of 2), and how many
+ * clusters no cell holds anymore are kept before freeing them */
+#define TB_CLUSTER_BUCKETS 1024
+#define TB_CLUSTER_UNUSED_MAX 1024
+
+/* Typical lengths of a cursor jump and an attribute change, as estimated by
+ * present_repaint() */
+#define TB_REPAINT_JUMP_COST 6
+#define TB_REPAINT_ATTR_COST 8
+
+/* Most threads tb_set_diff_threads() starts, counting the caller */
+#define TB_DIFF_THREADS_MAX 8
+
+/* Rows above and below the cursor sent first when over the present budget */
+#define TB_BUDGET_CURSOR_ROWS 1
+
+/* Length of the plain-data prefix of a cell (ch, fg, bg) */
+#define TB_CELL_KEY_LEN (offsetof(struct cell_t, bg) + sizeof(uintattr_t))
+
+/* Set in the ch of a cell holding a grapheme cluster, along with its id */
+#define TB_CLUSTER_BIT 0x80000000
+
 #define if_err_return(rv, expr)                                                \
     if (((rv) = (expr)) != TB_OK)                                              \
     return (rv)
@@ -597,11 +1009,11 @@ const char *tb_version(void);
     return (rv)
 
 #define send_literal(rv, a)                                                    \
-    if_err_return((rv), bytebuf_nputs(&global.out, (a), sizeof(a) - 1))
+    if_err_return((rv), bytebuf_nputs(&enc->out, (a), sizeof(a) - 1))
 
 #define send_num(rv, nbuf, n)                                                  \
     if_err_return((rv),                                                        \
-        bytebuf_nputs(&global.out, (nbuf), convert_num((n), (nbuf))))
+        bytebuf_nputs(&enc->out, (nbuf), convert_num((n), (nbuf))))
 
 #define snprintf_or_return(rv, str, sz, fmt, ...)                              \
     do {                                                                       \
@@ -618,13 +1030,213 @@ struct bytebuf_t {
     char *buf;
     size_t len;
     size_t cap;
+    size_t off; /* bytes of buf already written by bytebuf_flush() */
+};
+
+/* A cell as the cell buffers hold it. Without TB_OPT_EGC, it's laid out as
+ * struct tb_cell, so tb_cell_buffer() hands out the back buffer itself. With
+ * it, a cell holding a grapheme cluster has TB_CLUSTER_BIT and the cluster's
+ * id in ch instead, so cells stay plain data as small as without clusters.
+ * tb_cell_buffer() then hands out a copy of the back buffer as struct tb_cell,
+ * see view_load(). With TB_OPT_SOA, cell buffers hold the fields in separate
+ * arrays instead, and this is only the layout of a row cache key. */
+struct cell_t {
+    uint32_t ch;
+    uintattr_t fg;
+    uintattr_t bg;
+};
+
+#ifndef TB_OPT_EGC
+/* Fails to compile if struct cell_t and struct tb_cell are laid out apart */
+typedef char cell_t_is_tb_cell[
+    sizeof(struct cell_t) == sizeof(struct tb_cell) &&
+            offsetof(struct cell_t, ch) == offsetof(struct tb_cell, ch) &&
+            offsetof(struct cell_t, fg) == offsetof(struct tb_cell, fg) &&
+            offsetof(struct cell_t, bg) == offsetof(struct tb_cell, bg)
+        ? 1
+        : -1];
+#endif
+
+struct cellspan_t {
+    int x0;
+    int x1;
 };
 
+/* Cells are addressed by index, y * width + x, and their fields accessed with
+ * cell_ch(), cell_fg() and cell_bg(), so the layout is left to TB_OPT_SOA */
 struct cellbuf_t {
     int width;
     int height;
-    struct tb_cell *cells;
+#ifdef TB_OPT_SOA
+    uint32_t *ch;
+    uintattr_t *fg;
+    uintattr_t *bg;
+#else
+    struct cell_t *cells;
+#endif
+    struct cellspan_t *dirty; /* per-row columns changed since last present,
+                                 in the front buffer since last hashed */
+    uint8_t *widths;          /* per-cell display width, 0 if not cached */
+    uint32_t *hashes;         /* per-row hash, see cellbuf_hash_rows() */
+    int cap;                  /* cells allocated, see cellbuf_resize() */
+    int rows_cap;             /* rows allocated for dirty and hashes */
+};
+
+#ifdef TB_OPT_SOA
+#define cell_ch(c, i) ((c)->ch[i])
+#define cell_fg(c, i) ((c)->fg[i])
+#define cell_bg(c, i) ((c)->bg[i])
+#else
+#define cell_ch(c, i) ((c)->cells[i].ch)
+#define cell_fg(c, i) ((c)->cells[i].fg)
+#define cell_bg(c, i) ((c)->cells[i].bg)
+#endif
+
+/* What the terminal renders for an fg/bg pair in the current output mode */
+struct sgr_t {
+    int attrs;      /* TB_SGR_* */
+    uintattr_t cfg; /* fg color, 0 if TB_SGR_FG_DEFAULT */
+    uintattr_t cbg; /* bg color, 0 if TB_SGR_BG_DEFAULT */
+};
+
+/* An attribute change sent by send_attr(), see sgr_cache_slot() */
+struct sgr_cache_entry_t {
+    int mode; /* output mode, 0 if unused */
+    uintattr_t from_fg;
+    uintattr_t from_bg;
+    uintattr_t fg;
+    uintattr_t bg;
+    struct sgr_t sgr; /* state after sending seq */
+    uint8_t len;
+    char seq[TB_SGR_PARAMS_LEN + 3];
+};
+
+/* What the terminal was left with by the bytes sent so far */
+struct term_state_t {
+    int last_x;
+    int last_y;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+    struct sgr_t last_sgr;
+    int has_last_sgr;
+};
+
+/* Output and the terminal state it leaves, with the stats of the frame. enc
+ * points to global.encoder, except in the diff threads, which each encode
+ * their band of rows into one of their own (see present_bands()). */
+struct encoder_t {
+    struct bytebuf_t out;
+    int last_x; /* -1 if unknown, width if an autowrap is pending */
+    int last_y;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+    struct sgr_t last_sgr;
+    int has_last_sgr;
+    int erased_x; /* cells send_run() erased in the row being sent, */
+    int erased_y; /* see motion_cells() */
+    int erased_n;
+    struct sgr_cache_entry_t sgr_cache[TB_SGR_CACHE_SIZE];
+    struct tb_stats stats;
+};
+
+/* A row sent whole by present_row(), see present_row_cached() */
+struct row_cache_entry_t {
+    struct row_cache_entry_t *next;  /* in the same bucket */
+    struct row_cache_entry_t *newer; /* in order of use */
+    struct row_cache_entry_t *older;
+    size_t size; /* allocated, including what follows */
+    uint32_t hash;
+    int y;
+    int width;
+    struct term_state_t from; /* before the row was sent */
+    struct term_state_t to;   /* after it was sent */
+    size_t cells;
+    size_t cursor_moves;
+    size_t cursor_bytes;
+    size_t len; /* bytes sent */
+    /* The first TB_CELL_KEY_LEN bytes of each back cell, then of each front
+     * cell, then the bytes sent */
+    char data[];
+};
+
+struct row_cache_t {
+    struct row_cache_entry_t *buckets[TB_ROW_CACHE_BUCKETS];
+    struct row_cache_entry_t *newest;
+    struct row_cache_entry_t *oldest;
+    size_t size;
+    size_t max_size; /* 0 if disabled */
+};
+
+#ifdef TB_OPT_EGC
+/* A grapheme cluster shared by the cells holding it, see cluster_get() */
+struct cluster_t {
+    struct cluster_t *next; /* in the same bucket */
+    uint32_t hash;
+    uint32_t id;
+    size_t refs; /* cells holding it */
+    size_t nch;
+    uint32_t ch[]; /* nch code points, then 0 */
+};
+
+struct cluster_table_t {
+    struct cluster_t *buckets[TB_CLUSTER_BUCKETS];
+    size_t nused;
+    size_t nunused; /* kept in case a cell takes them again */
+    struct cluster_t **ids; /* by id, NULL if free */
+    uint32_t *free_ids;
+    size_t nids; /* ids handed out, including free ones */
+    size_t nfree;
+    size_t cids; /* capacity of ids and free_ids */
+#ifdef TB_OPT_RENDER_THREAD
+    pthread_mutex_t lock; /* used while the render thread runs */
+#endif
+};
+#endif
+
+#ifdef TB_OPT_RENDER_THREAD
+struct render_thread_t {
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards next and the flags below */
+    pthread_cond_t cond;  /* signaled when a flag changes */
+    struct cellbuf_t next;  /* changes handed off by tb_present() */
+    struct cellbuf_t cells; /* copy of the back buffer the thread presents */
+    int running;
+    int has_frame; /* next holds changes the thread hasn't taken */
+    int busy;      /* the thread is presenting cells */
+    int quit;
+    int rv; /* first error from a frame, reported by tb_present() */
+};
+#endif
+
+#ifdef TB_OPT_DIFF_THREADS
+/* A row a diff thread encoded, see present_bands() */
+struct band_row_t {
+    struct term_state_t from; /* state the row was encoded from */
+    struct term_state_t to;
+    size_t off; /* where the row starts in the thread's output */
+    size_t len; /* 0 if the row didn't change */
+    size_t cells;
+    size_t cursor_moves;
+    size_t cursor_bytes;
+    size_t sgr_cache_hits;
+    size_t sgr_cache_misses;
+};
+
+struct diff_pool_t {
+    pthread_t threads[TB_DIFF_THREADS_MAX - 1];
+    int ids[TB_DIFF_THREADS_MAX - 1]; /* band - 1 of each thread */
+    int rv[TB_DIFF_THREADS_MAX - 1];  /* from encoding each band */
+    struct encoder_t *encoders;       /* one per thread, NULL if stopped */
+    struct band_row_t *rows;          /* rows of the frame, by y */
+    int nrows;
+    int nthreads;         /* threads besides the one presenting */
+    pthread_mutex_t lock; /* guards the fields below */
+    pthread_cond_t cond;  /* signaled when a field changes */
+    int gen;              /* incremented for each frame to compare */
+    int busy;             /* threads still comparing rows of the frame */
+    int quit;
 };
+#endif
 
 struct cap_trie_t {
     char c;
@@ -645,33 +1257,78 @@ struct tb_global_t {
     int height;
     int cursor_x;
     int cursor_y;
-    int last_x;
-    int last_y;
     uintattr_t fg;
     uintattr_t bg;
-    uintattr_t last_fg;
-    uintattr_t last_bg;
+    struct encoder_t encoder;
+    struct row_cache_t row_cache;
     int input_mode;
     int output_mode;
+    int present_mode;
+    int present_swap; /* present_diff() swaps buffers instead of copying */
+    int present_banded; /* present_bands() updates the front rows afterwards */
+    int sync_mode;
+    int flush_mode;
+    int wfd_flags; /* fcntl() flags of wfd to restore, or -1 if untouched */
+    int max_fps;
+    size_t present_budget;
+    int priority_x;
+    int priority_y;
+    int priority_w;
+    int priority_h;
+    int frame_pending;   /* tb_present() held back a frame */
+    int64_t frame_time;  /* monotonic time the last frame was sent, in us */
+    size_t frames_merged;
+    size_t frames_dropped;
+    int has_sync;  /* terminal reported support for mode 2026 */
+    int sync_query; /* the mode 2026 query is still awaiting its reply */
+    int nreplies;  /* replies to queries consumed by extract_event() */
+    int opt_caps;
     char *terminfo;
     size_t nterminfo;
     const char *caps[TB_CAP__COUNT];
     struct cap_trie_t cap_trie;
     struct bytebuf_t in;
-    struct bytebuf_t out;
     struct cellbuf_t back;
     struct cellbuf_t front;
+    struct cellbuf_t *draw; /* cells tb_present() sends, &back or a copy */
+#ifdef TB_OPT_EGC
+    struct cluster_table_t clusters;
+#endif
+#ifdef TB_CELL_VIEW
+    struct tb_cell *view; /* see tb_cell_buffer(), NULL if unused */
+    int view_out; /* view may hold writes view_store() hasn't taken in */
+#endif
+#ifdef TB_OPT_SOA
+    uint8_t *rows_out; /* rows handed out by tb_cell_row(), NULL if none yet */
+    int nrows_out;
+#ifdef TB_OPT_EGC
+    uint32_t *rows_ch; /* ch of the back buffer as of then, see rows_store() */
+#endif
+#endif
+#ifdef TB_OPT_RENDER_THREAD
+    struct render_thread_t render;
+#endif
+#ifdef TB_OPT_DIFF_THREADS
+    struct diff_pool_t diff_pool;
+#endif
     struct termios orig_tios;
     int has_orig_tios;
     int last_errno;
     int initialized;
     int (*fn_extract_esc_pre)(struct tb_event *, size_t *);
     int (*fn_extract_esc_post)(struct tb_event *, size_t *);
+    size_t (*mem_diff)(const void *, const void *, size_t);
     char errbuf[1024];
 };
 
 static struct tb_global_t global = {0};
 
+#ifdef TB_OPT_DIFF_THREADS
+static __thread struct encoder_t *enc = &global.encoder;
+#else
+static struct encoder_t *enc = &global.encoder;
+#endif
+
 /* BEGIN codegen c */
 /* Produced by ./codegen.sh on Sun, 19 Sep 2021 01:02:03 +0000 */
 
@@ -1342,6 +1999,30 @@ static struct {
     {NULL,           0,                  0                                      },
 };
 
+/* Optional caps, probed by terminfo string index. Their sequences are not
+ * read from terminfo but hard-coded like TB_HARDCAP_*, so only presence is
+ * checked. Built-in terms get TB_OPTCAP_BUILTIN. */
+#define TB_OPTCAP_BUILTIN                                                      \
+    (TB_OPTCAP_CSR | TB_OPTCAP_CUF | TB_OPTCAP_CUB | TB_OPTCAP_CUU |           \
+        TB_OPTCAP_CUD | TB_OPTCAP_EL | TB_OPTCAP_AM)
+static const struct {
+    int16_t index;
+    int flag;
+} terminfo_opt_caps[] = {
+    {3,   TB_OPTCAP_CSR},
+    {109, TB_OPTCAP_INDN},
+    {113, TB_OPTCAP_RIN},
+    {8,   TB_OPTCAP_HPA},
+    {127, TB_OPTCAP_VPA},
+    {112, TB_OPTCAP_CUF},
+    {111, TB_OPTCAP_CUB},
+    {114, TB_OPTCAP_CUU},
+    {107, TB_OPTCAP_CUD},
+    {37,  TB_OPTCAP_ECH},
+    {6,   TB_OPTCAP_EL},
+    {121, TB_OPTCAP_REP},
+};
+
 static const unsigned char utf8_length[256] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
@@ -1378,38 +2059,148 @@ static int load_terminfo_from_path(const char *path, const char *term);
 static int read_terminfo_path(const char *path);
 static int parse_terminfo_caps(void);
 static int load_builtin_caps(void);
+static int probe_terminfo_opt_caps(int16_t str_offsets_pos,
+    int16_t str_table_len, int16_t nstrs);
 static const char *get_terminfo_string(int16_t str_offsets_pos,
     int16_t str_table_pos, int16_t str_table_len, int16_t str_index);
 static int wait_event(struct tb_event *event, int timeout);
 static int extract_event(struct tb_event *event);
 static int extract_esc(struct tb_event *event);
+static int extract_esc_reply(void);
 static int extract_esc_user(struct tb_event *event, int is_post);
 static int extract_esc_cap(struct tb_event *event);
 static int extract_esc_mouse(struct tb_event *event);
 static int resize_cellbufs(void);
 static void handle_resize(int sig);
+static int present_frame(void);
+static int present_diff(int x, int y, int w, int h);
+static int present_encode(int x, int y, int w, int h);
+static int present_estimate(struct tb_present_cost *cost);
+static int present_rows(size_t frame_start);
+static int present_rows_region(int x0, int y0, int x1, int y1);
+static int present_row(int y, int x0, int x1);
+static int present_row_cached(int y, int x0, int x1);
+static int present_row_commit(int y);
+static int present_swap(void);
+static int present_rows_budget(size_t frame_start);
+static void render_wait(void);
+#ifdef TB_OPT_RENDER_THREAD
+static int render_start(void);
+static int render_stop(void);
+static int render_submit(void);
+static void *render_main(void *arg);
+#endif
+#ifdef TB_OPT_DIFF_THREADS
+static int diff_pool_start(int nthreads);
+static int diff_pool_stop(void);
+static void *diff_pool_main(void *arg);
+static int present_bands(void);
+static int present_band(int y0, int y1);
+#endif
+static int present_scroll(void);
+static int present_repaint(void);
+static int present_held(void);
+static int64_t present_due_us(void);
+static int64_t monotonic_us(void);
 static int send_attr(uintattr_t fg, uintattr_t bg);
 static int send_sgr(uintattr_t fg, uintattr_t bg, uintattr_t fg_is_default,
     uintattr_t bg_is_default);
+static int send_sgr_delta(struct sgr_t *from, struct sgr_t *to);
+static struct sgr_cache_entry_t *sgr_cache_slot(uintattr_t from_fg,
+    uintattr_t from_bg, uintattr_t fg, uintattr_t bg);
+static int sgr_color_param(char *buf, uintattr_t c, int is_bg);
+static void term_state_save(struct term_state_t *s);
+static void term_state_restore(struct term_state_t *s);
+static int term_state_eq(struct term_state_t *a, struct term_state_t *b);
+static struct row_cache_entry_t *row_cache_find(uint32_t hash, int y,
+    struct term_state_t *from);
+static void row_cache_add(struct row_cache_entry_t *e);
+static void row_cache_link(struct row_cache_entry_t *e);
+static void row_cache_unlink(struct row_cache_entry_t *e);
+static void row_cache_trim(size_t max_size);
+static void sgr_append(char *buf, int *len, const char *param, int nparam);
+static int caps_are_ecma_sgr(void);
 static int send_cursor_if(int x, int y);
-static int send_char(int x, int y, uint32_t ch);
-static int send_cluster(int x, int y, uint32_t *ch, size_t nch);
+static int send_motion(int x, int y);
+static struct cellbuf_t *motion_cells(int x, int y);
+static int send_cup(int x, int y);
+static int send_csi_num(int n, char final);
+static int motion_num_cost(int n);
+static int motion_hcost(int c, int x, int y, int limit, int *kind);
+static int send_scroll(int top, int bot, int n);
+static int send_run(int x, int y, int x1, int *nrun);
+static int send_char(int x, int y, uint32_t ch, int w);
+static int send_cluster(int x, int y, uint32_t *ch, size_t nch, int w);
 static int convert_num(uint32_t num, char *buf);
-static int cell_cmp(struct tb_cell *a, struct tb_cell *b);
-static int cell_copy(struct tb_cell *dst, struct tb_cell *src);
-static int cell_set(struct tb_cell *cell, uint32_t *ch, size_t nch,
+static int cell_width(struct cellbuf_t *c, int i);
+static int cell_cmp(struct cellbuf_t *a, int ai, struct cellbuf_t *b, int bi);
+static int cell_is_erasable(struct cellbuf_t *c, int i);
+static int cell_is_blank(struct cellbuf_t *c, int i, int default_bg);
+static int cell_run_cmp(struct cellbuf_t *a, int ai, struct cellbuf_t *b,
+    int bi, int n);
+static size_t mem_diff_scalar(const void *a, const void *b, size_t n);
+#ifdef TB_SIMD_X86
+static size_t mem_diff_sse2(const void *a, const void *b, size_t n);
+static size_t mem_diff_avx2(const void *a, const void *b, size_t n);
+#endif
+static int cell_copy(struct cellbuf_t *dst, int di, struct cellbuf_t *src,
+    int si);
+static int cell_set(struct cellbuf_t *c, int i, uint32_t *ch, size_t nch,
     uintattr_t fg, uintattr_t bg);
-static int cell_reserve_ech(struct tb_cell *cell, size_t n);
-static int cell_free(struct tb_cell *cell);
+static int cell_free(struct cellbuf_t *c, int i);
+#ifdef TB_OPT_EGC
+static int cluster_get(uint32_t *ch, size_t nch, uint32_t *out);
+static struct cluster_t *cluster_find(uint32_t ch);
+static void cluster_hold(uint32_t ch);
+static void cluster_drop(uint32_t ch);
+static void cluster_sweep(int all);
+static void cluster_lock(void);
+static void cluster_unlock(void);
+static int cell_has_cluster(struct cellbuf_t *c, int i);
+#endif
+static void view_load(int i, int n);
+static int view_store(void);
+#ifdef TB_CELL_VIEW
+static int view_store_cell(int i);
+#endif
+static void view_free(void);
+#ifdef TB_OPT_SOA
+static int rows_store(void);
+#endif
 static int cellbuf_init(struct cellbuf_t *c, int w, int h);
 static int cellbuf_free(struct cellbuf_t *c);
 static int cellbuf_clear(struct cellbuf_t *c);
-static int cellbuf_get(struct cellbuf_t *c, int x, int y, struct tb_cell **out);
+static void cellbuf_fill(struct cellbuf_t *c, int i, int n, uintattr_t fg,
+    uintattr_t bg);
+static void cellbuf_blank(struct cellbuf_t *c, int i, int n, uintattr_t fg,
+    uintattr_t bg);
+static void cellbuf_drop(struct cellbuf_t *c, int i, int n);
+static void cellbuf_move(struct cellbuf_t *c, int dst, int src, int n);
+static int cellbuf_get(struct cellbuf_t *c, int x, int y, int *out);
+static int cellbuf_set(struct cellbuf_t *c, int x, int y, uint32_t *ch,
+    size_t nch, uintattr_t fg, uintattr_t bg, int w);
 static int cellbuf_resize(struct cellbuf_t *c, int w, int h);
+static int cellbuf_realloc(struct cellbuf_t *c, int cap, int rows_cap);
+static int cellbuf_dirty(struct cellbuf_t *c, int x0, int y0, int x1, int y1);
+static int cellbuf_dirty_all(struct cellbuf_t *c);
+#ifdef TB_OPT_RENDER_THREAD
+static int cellbuf_copy_dirty(struct cellbuf_t *dst, struct cellbuf_t *src);
+#endif
+static int cellbuf_hash_rows(struct cellbuf_t *c, int y0, int y1);
+static int cellbuf_row_eq(struct cellbuf_t *a, int ay, struct cellbuf_t *b,
+    int by);
+static int cellbuf_row_uniform(struct cellbuf_t *c, int y);
+static void cellbuf_row_key(struct cellbuf_t *c, int y, char *key);
+static int cellbuf_row_key_eq(struct cellbuf_t *c, int y, const char *key);
+static void cellbuf_swap_cells(struct cellbuf_t *a, struct cellbuf_t *b);
+static int cellbuf_reverse_rows(struct cellbuf_t *c, int y0, int y1);
+static int cellbuf_scroll(struct cellbuf_t *c, int top, int bot, int n,
+    uintattr_t fg, uintattr_t bg);
 static int bytebuf_puts(struct bytebuf_t *b, const char *str);
 static int bytebuf_nputs(struct bytebuf_t *b, const char *str, size_t nstr);
 static int bytebuf_shift(struct bytebuf_t *b, size_t n);
 static int bytebuf_flush(struct bytebuf_t *b, int fd);
+static int bytebuf_flush_nonblock(struct bytebuf_t *b, int fd);
 static int bytebuf_reserve(struct bytebuf_t *b, size_t sz);
 static int bytebuf_free(struct bytebuf_t *b);
 
@@ -1479,7 +2270,10 @@ int tb_height(void) {
 
 int tb_clear(void) {
     if_not_init_return();
-    return cellbuf_clear(&global.back);
+    int rv;
+    if_err_return(rv, cellbuf_clear(&global.back));
+    view_load(0, global.back.width * global.back.height);
+    return TB_OK;
 }
 
 int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg) {
@@ -1491,73 +2285,180 @@ int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg) {
 
 int tb_present(void) {
     if_not_init_return();
+    int rv;
+    if_err_return(rv, view_store());
+    if (present_held()) {
+        return TB_OK;
+    }
+    return present_frame();
+}
 
+int tb_present_region(int x, int y, int w, int h) {
+    if_not_init_return();
     int rv;
+    if_err_return(rv, view_store());
+#ifdef TB_OPT_RENDER_THREAD
+    if (global.render.running) {
+        // The thread only presents whole frames
+        return present_held() ? TB_OK : present_frame();
+    }
+#endif
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    w = x + w > global.front.width ? global.front.width - x : w;
+    h = y + h > global.front.height ? global.front.height - y : h;
+    if (w <= 0 || h <= 0) {
+        return TB_ERR_OUT_OF_BOUNDS;
+    }
+    if (present_held()) {
+        return TB_OK;
+    }
+    if (global.frame_pending) {
+        // A held-back frame is due, and it has this region's changes too
+        return present_frame();
+    }
+    global.frame_time = monotonic_us();
+    return present_diff(x, y, w, h);
+}
 
-    // TODO Assert global.back.(width,height) == global.front.(width,height)
+int tb_present_estimate(struct tb_present_cost *cost) {
+    if_not_init_return();
+    render_wait();
+    int rv;
+    if_err_return(rv, view_store());
+#ifdef TB_OPT_RENDER_THREAD
+    if (global.render.running) {
+        // Hand the changes to the thread's copy the way tb_present() and the
+        // thread would, so they're estimated along with any it has left over
+        if_err_return(rv,
+            cellbuf_copy_dirty(&global.render.next, &global.back));
+        if_err_return(rv,
+            cellbuf_copy_dirty(&global.render.cells, &global.render.next));
+    }
+#endif
+    return present_estimate(cost);
+}
 
-    global.last_x = -1;
-    global.last_y = -1;
+int tb_get_stats(struct tb_stats *stats) {
+    if_not_init_return();
+    render_wait();
+    *stats = enc->stats;
+    if (global.frame_pending && !stats->deferred) {
+        // The most recent tb_present() was held back by pacing
+        memset(stats, 0, sizeof(*stats));
+        stats->deferred = 1;
+    }
+    stats->frames_merged = global.frames_merged;
+    stats->frames_dropped = global.frames_dropped;
+    stats->row_cache_bytes = global.row_cache.size;
+    return TB_OK;
+}
 
-    int x, y, i;
-    for (y = 0; y < global.front.height; y++) {
-        for (x = 0; x < global.front.width;) {
-            struct tb_cell *back, *front;
-            if_err_return(rv, cellbuf_get(&global.back, x, y, &back));
-            if_err_return(rv, cellbuf_get(&global.front, x, y, &front));
+int tb_set_max_fps(int fps) {
+    if_not_init_return();
+    if (fps < 0) {
+        return global.max_fps;
+    }
+    global.max_fps = fps;
+    if (fps == 0 && global.frame_pending) {
+        // Nothing holds it back anymore
+        return present_frame();
+    }
+    return TB_OK;
+}
 
-            int w;
-            {
-#ifdef TB_OPT_EGC
-                if (back->nech > 0)
-                    w = wcswidth((wchar_t *)back->ech, back->nech);
-                else
-#endif
-                    /* wcwidth() simply returns -1 on overflow of wchar_t */
-                    w = wcwidth((wchar_t)back->ch);
-            }
-            if (w < 1) {
-                w = 1;
-            }
+int tb_frame_due_ms(void) {
+    if_not_init_return();
+    if (!global.frame_pending) {
+        return -1;
+    }
+    int64_t due_us = present_due_us();
+    return due_us > 0 ? (int)((due_us + 999) / 1000) : 0;
+}
+
+int tb_set_present_budget(int bytes) {
+    if_not_init_return();
+    if (bytes < 0) {
+        return (int)global.present_budget;
+    }
+    render_wait();
+    global.present_budget = (size_t)bytes;
+    return TB_OK;
+}
 
-            if (cell_cmp(back, front) != 0) {
-                cell_copy(front, back);
+int tb_set_priority_rect(int x, int y, int w, int h) {
+    if_not_init_return();
+    render_wait();
+    global.priority_x = x < 0 ? 0 : x;
+    global.priority_y = y < 0 ? 0 : y;
+    global.priority_w = w;
+    global.priority_h = h;
+    return TB_OK;
+}
 
-                send_attr(back->fg, back->bg);
-                if (w > 1 && x >= global.front.width - (w - 1)) {
-                    for (i = x; i < global.front.width; i++) {
-                        send_char(i, y, ' ');
-                    }
-                } else {
-                    {
-#ifdef TB_OPT_EGC
-                        if (back->nech > 0)
-                            send_cluster(x, y, back->ech, back->nech);
-                        else
+int tb_set_diff_threads(int n) {
+    if_not_init_return();
+#ifdef TB_OPT_DIFF_THREADS
+    if (n < 0) {
+        return global.diff_pool.nthreads + 1;
+    }
+    render_wait();
+    diff_pool_stop();
+    n = n > TB_DIFF_THREADS_MAX ? TB_DIFF_THREADS_MAX : n;
+    return n > 1 ? diff_pool_start(n - 1) : TB_OK;
+#else
+    (void)n;
+    return TB_ERR;
 #endif
-                            send_char(x, y, back->ch);
-                    }
-                    for (i = 1; i < w; i++) {
-                        struct tb_cell *front_wide;
-                        if_err_return(rv,
-                            cellbuf_get(&global.front, x + i, y, &front_wide));
-                        if_err_return(rv,
-                            cell_set(front_wide, 0, 1, back->fg, back->bg));
-                    }
-                }
-            }
-            x += w;
-        }
+}
+
+int tb_set_row_cache(int bytes) {
+    if_not_init_return();
+    if (bytes < 0) {
+        return (int)global.row_cache.max_size;
     }
+    render_wait();
+    global.row_cache.max_size = (size_t)bytes;
+    row_cache_trim(global.row_cache.max_size);
+    return TB_OK;
+}
 
-    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+int tb_set_render_thread(int enable) {
+    if_not_init_return();
+#ifdef TB_OPT_RENDER_THREAD
+    if (enable < 0) {
+        return global.render.running;
+    }
+    return enable ? render_start() : render_stop();
+#else
+    (void)enable;
+    return TB_ERR;
+#endif
+}
 
-    return TB_OK;
+int tb_invalidate(void) {
+    if_not_init_return();
+    int rv;
+#ifdef TB_CELL_VIEW
+    // The caller may have written to the copy since the last present
+    global.view_out = global.view != NULL;
+#endif
+    if_err_return(rv, view_store());
+    // Cells may have been written directly, so widths are recomputed lazily
+    memset(global.back.widths, 0,
+        (size_t)global.back.width * global.back.height);
+    return cellbuf_dirty_all(&global.back);
 }
 
 int tb_set_cursor(int cx, int cy) {
     if_not_init_return();
+    render_wait();
     int rv;
     if (cx < 0)
         cx = 0;
@@ -1565,7 +2466,7 @@ int tb_set_cursor(int cx, int cy) {
         cy = 0;
     if (global.cursor_x == -1) {
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_SHOW_CURSOR]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_SHOW_CURSOR]));
     }
     if_err_return(rv, send_cursor_if(cx, cy));
     global.cursor_x = cx;
@@ -1575,10 +2476,11 @@ int tb_set_cursor(int cx, int cy) {
 
 int tb_hide_cursor(void) {
     if_not_init_return();
+    render_wait();
     int rv;
     if (global.cursor_x >= 0) {
         if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_HIDE_CURSOR]));
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_HIDE_CURSOR]));
     }
     global.cursor_x = -1;
     global.cursor_y = -1;
@@ -1594,32 +2496,48 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg) {
     if_not_init_return();
     int rv;
-    struct tb_cell *cell;
-    if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
-    if_err_return(rv, cell_set(cell, ch, nch, fg, bg));
+    if_err_return(rv, cellbuf_set(&global.back, x, y, ch, nch, fg, bg, -1));
+    view_load(y * global.back.width + x, 1);
     return TB_OK;
 }
 
 int tb_extend_cell(int x, int y, uint32_t ch) {
     if_not_init_return();
 #ifdef TB_OPT_EGC
-    int rv;
-    struct tb_cell *cell;
+    int rv, i;
     size_t nech;
-    if_err_return(rv, cellbuf_get(&global.back, x, y, &cell));
-    if (cell->nech > 0) { // append to ech
-        nech = cell->nech + 1;
-        if_err_return(rv, cell_reserve_ech(cell, nech));
-        cell->ech[nech - 1] = ch;
+    struct cellbuf_t *back = &global.back;
+    if_err_return(rv, cellbuf_get(back, x, y, &i));
+#ifdef TB_OPT_SOA
+    if_err_return(rv, rows_store());
+#endif
+    if_err_return(rv, view_store_cell(i));
+    // The cell's cluster is shared, so the extended one is looked up anew
+    struct cluster_t *c = cluster_find(cell_ch(back, i));
+    uint32_t buf[16];
+    uint32_t *ech = buf;
+    nech = c ? c->nch + 1 : 2;
+    if (nech > sizeof(buf) / sizeof(buf[0]) &&
+        !(ech = tb_malloc(nech * sizeof(*ech))))
+    {
+        return TB_ERR_MEM;
+    }
+    if (c) { // append to ech
+        memcpy(ech, c->ch, c->nch * sizeof(*ech));
     } else { // make new ech
-        nech = 2;
-        if_err_return(rv, cell_reserve_ech(cell, nech));
-        cell->ech[0] = cell->ch;
-        cell->ech[1] = ch;
+        ech[0] = cell_ch(back, i);
     }
-    cell->ech[nech] = '\0';
-    cell->nech = nech;
-    return TB_OK;
+    ech[nech - 1] = ch;
+    rv = cell_set(back, i, ech, nech, cell_fg(back, i), cell_bg(back, i));
+    if (ech != buf) {
+        tb_free(ech);
+    }
+    if (rv != TB_OK) {
+        return rv;
+    }
+    back->widths[i] = cell_width(back, i);
+    view_load(i, 1);
+    return cellbuf_dirty(back, x, y, x, y);
 #else
     (void)x;
     (void)y;
@@ -1628,10 +2546,108 @@ int tb_extend_cell(int x, int y, uint32_t ch) {
 #endif
 }
 
-int tb_set_input_mode(int mode) {
+int tb_cell_row(int y, uint32_t **ch, uintattr_t **fg, uintattr_t **bg) {
     if_not_init_return();
-    if (mode == TB_INPUT_CURRENT) {
-        return global.input_mode;
+#ifdef TB_OPT_SOA
+    struct cellbuf_t *back = &global.back;
+    int n = back->width * back->height;
+    if (y < 0 || y >= back->height) {
+        return TB_ERR_OUT_OF_BOUNDS;
+    }
+    if (!global.rows_out) {
+        if (!(global.rows_out = tb_malloc(back->height))) {
+            return TB_ERR_MEM;
+        }
+        memset(global.rows_out, 0, back->height);
+    }
+#ifdef TB_OPT_EGC
+    // Which clusters the row held, see rows_store()
+    if (!global.rows_ch) {
+        if (!(global.rows_ch = tb_malloc(sizeof(uint32_t) * n))) {
+            return TB_ERR_MEM;
+        }
+        memcpy(global.rows_ch, back->ch, sizeof(uint32_t) * n);
+    }
+#else
+    (void)n;
+#endif
+    if (!global.rows_out[y]) {
+        global.rows_out[y] = 1;
+        global.nrows_out++;
+    }
+    *ch = &back->ch[y * back->width];
+    *fg = &back->fg[y * back->width];
+    *bg = &back->bg[y * back->width];
+    return cellbuf_dirty(back, 0, y, back->width - 1, y);
+#else
+    (void)y;
+    (void)ch;
+    (void)fg;
+    (void)bg;
+    return TB_ERR;
+#endif
+}
+
+int tb_blit(int x, int y, int w, int h, const struct tb_cell *src,
+    int src_stride) {
+    if_not_init_return();
+    struct cellbuf_t *back = &global.back;
+    int rv = TB_OK, row, k;
+    if (!src || src_stride < w) {
+        return TB_ERR;
+    }
+    if (x < 0) {
+        src -= x;
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        src -= (ptrdiff_t)y * src_stride;
+        h += y;
+        y = 0;
+    }
+    w = w > back->width - x ? back->width - x : w;
+    h = h > back->height - y ? back->height - y : h;
+    if (w <= 0 || h <= 0) {
+        return TB_ERR_OUT_OF_BOUNDS;
+    }
+    if_err_return(rv, cellbuf_dirty(back, x, y, x + w - 1, y + h - 1));
+    for (row = y; row < y + h; row++, src += src_stride) {
+        int i = row * back->width + x;
+#if !defined(TB_OPT_EGC) && !defined(TB_OPT_SOA)
+        // The back buffer holds struct tb_cell as is
+        memcpy(&back->cells[i], src, sizeof(*src) * w);
+        k = w;
+#else
+        for (k = 0; k < w && rv == TB_OK; k++) {
+#ifdef TB_OPT_EGC
+            uint32_t ch = src[k].ch;
+            rv = src[k].nech > 0 ? cell_set(back, i + k, src[k].ech,
+                                       src[k].nech, src[k].fg, src[k].bg)
+                                 : cell_set(back, i + k, &ch, 1, src[k].fg,
+                                       src[k].bg);
+#else
+            cell_ch(back, i + k) = src[k].ch;
+            cell_fg(back, i + k) = src[k].fg;
+            cell_bg(back, i + k) = src[k].bg;
+#endif
+        }
+#endif
+        // Widths are found as the cells are sent
+        memset(&back->widths[i], 0, k);
+        view_load(i, k);
+        if (rv != TB_OK) {
+            return rv;
+        }
+    }
+    return TB_OK;
+}
+
+int tb_set_input_mode(int mode) {
+    if_not_init_return();
+    render_wait();
+    if (mode == TB_INPUT_CURRENT) {
+        return global.input_mode;
     }
 
     if ((mode & (TB_INPUT_ESC | TB_INPUT_ALT)) == 0) {
@@ -1644,11 +2660,11 @@ int tb_set_input_mode(int mode) {
     }
 
     if (mode & TB_INPUT_MOUSE) {
-        bytebuf_puts(&global.out, TB_HARDCAP_ENTER_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        bytebuf_puts(&enc->out, TB_HARDCAP_ENTER_MOUSE);
+        bytebuf_flush(&enc->out, global.wfd);
     } else {
-        bytebuf_puts(&global.out, TB_HARDCAP_EXIT_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        bytebuf_puts(&enc->out, TB_HARDCAP_EXIT_MOUSE);
+        bytebuf_flush(&enc->out, global.wfd);
     }
 
     global.input_mode = mode;
@@ -1657,6 +2673,7 @@ int tb_set_input_mode(int mode) {
 
 int tb_set_output_mode(int mode) {
     if_not_init_return();
+    render_wait();
     switch (mode) {
         case TB_OUTPUT_CURRENT:
             return global.output_mode;
@@ -1668,11 +2685,109 @@ int tb_set_output_mode(int mode) {
         case TB_OUTPUT_TRUECOLOR:
 #endif
             global.output_mode = mode;
+            // The same attributes may now be sent differently
+            enc->last_fg = ~global.fg;
+            enc->last_bg = ~global.bg;
+            enc->has_last_sgr = 0;
+            memset(enc->sgr_cache, 0, sizeof(enc->sgr_cache));
+#ifdef TB_OPT_DIFF_THREADS
+            int i;
+            for (i = 0; i < global.diff_pool.nthreads; i++) {
+                memset(global.diff_pool.encoders[i].sgr_cache, 0,
+                    sizeof(enc->sgr_cache));
+            }
+#endif
+            row_cache_trim(0);
+            return TB_OK;
+    }
+    return TB_ERR;
+}
+
+int tb_set_present_mode(int mode) {
+    if_not_init_return();
+    render_wait();
+    if (mode == TB_PRESENT_CURRENT) {
+        return global.present_mode;
+    }
+
+    mode |= TB_PRESENT_NORMAL;
+
+    if (!(global.opt_caps & TB_OPTCAP_CSR)) {
+        mode &= ~TB_PRESENT_SCROLL;
+    }
+
+    global.present_mode = mode;
+    return TB_OK;
+}
+
+int tb_set_sync_mode(int mode) {
+    if_not_init_return();
+    render_wait();
+    switch (mode) {
+        case TB_SYNC_CURRENT:
+            return global.sync_mode;
+        case TB_SYNC_AUTO:
+        case TB_SYNC_ON:
+        case TB_SYNC_OFF:
+            global.sync_mode = mode;
+            return TB_OK;
+    }
+    return TB_ERR;
+}
+
+int tb_set_flush_mode(int mode) {
+    if_not_init_return();
+    render_wait();
+    int rv;
+    switch (mode) {
+        case TB_FLUSH_CURRENT:
+            return global.flush_mode;
+        case TB_FLUSH_BLOCKING:
+            if (global.wfd_flags >= 0) {
+                if_err_return(rv, bytebuf_flush(&enc->out, global.wfd));
+                if (fcntl(global.wfd, F_SETFL, global.wfd_flags) < 0) {
+                    global.last_errno = errno;
+                    return TB_ERR;
+                }
+                global.wfd_flags = -1;
+            }
+            global.flush_mode = mode;
+            return TB_OK;
+        case TB_FLUSH_APPEND:
+        case TB_FLUSH_COALESCE:
+            if (global.wfd_flags < 0) {
+                int flags = fcntl(global.wfd, F_GETFL);
+                if (flags < 0 ||
+                    fcntl(global.wfd, F_SETFL, flags | O_NONBLOCK) < 0)
+                {
+                    global.last_errno = errno;
+                    return TB_ERR;
+                }
+                global.wfd_flags = flags;
+            }
+            global.flush_mode = mode;
             return TB_OK;
     }
     return TB_ERR;
 }
 
+int tb_flush(void) {
+    if_not_init_return();
+    render_wait();
+    if (global.flush_mode == TB_FLUSH_BLOCKING) {
+        return bytebuf_flush(&enc->out, global.wfd);
+    }
+    return bytebuf_flush_nonblock(&enc->out, global.wfd);
+}
+
+int tb_get_pending(int *wfd, size_t *pending) {
+    if_not_init_return();
+    render_wait();
+    *wfd = global.wfd;
+    *pending = enc->out.len - enc->out.off;
+    return TB_OK;
+}
+
 int tb_peek_event(struct tb_event *event, int timeout_ms) {
     if_not_init_return();
     return wait_event(event, timeout_ms);
@@ -1713,7 +2828,10 @@ int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
         if (w == 0 && x > ix) {
             if_err_return(rv, tb_extend_cell(x - 1, y, uni));
         } else {
-            if_err_return(rv, tb_set_cell(x, y, uni, fg, bg));
+            if_not_init_return();
+            if_err_return(rv,
+                cellbuf_set(&global.back, x, y, &uni, 1, fg, bg, w));
+            view_load(y * global.back.width + x, 1);
         }
         x += w;
         if (out_w) {
@@ -1744,7 +2862,14 @@ int tb_printf_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 }
 
 int tb_send(const char *buf, size_t nbuf) {
-    return bytebuf_nputs(&global.out, buf, nbuf);
+    render_wait();
+    // The bytes may move the cursor or change attributes
+    enc->last_x = -1;
+    enc->last_y = -1;
+    enc->last_fg = ~global.fg;
+    enc->last_bg = ~global.bg;
+    enc->has_last_sgr = 0;
+    return bytebuf_nputs(&enc->out, buf, nbuf);
 }
 
 int tb_sendf(const char *fmt, ...) {
@@ -1775,7 +2900,28 @@ int tb_set_func(int fn_type, int (*fn)(struct tb_event *, size_t *)) {
 struct tb_cell *tb_cell_buffer(void) {
     if (!global.initialized)
         return NULL;
-    return global.back.cells;
+#ifdef TB_CELL_VIEW
+    // Cells aren't held as struct tb_cell, so hand out a copy that takes them
+    // in on the next present or tb_invalidate()
+    if (view_store() != TB_OK) {
+        return NULL;
+    }
+    if (!global.view) {
+        int n = global.back.width * global.back.height;
+        if (!(global.view = tb_malloc(sizeof(*global.view) * n))) {
+            return NULL;
+        }
+        view_load(0, n);
+    }
+    // The caller may write anywhere
+    tb_invalidate();
+    global.view_out = 1;
+    return global.view;
+#else
+    // The caller may write anywhere
+    tb_invalidate();
+    return (struct tb_cell *)global.back.cells;
+#endif
 }
 
 int tb_utf8_char_length(char c) {
@@ -1860,6 +3006,8 @@ const char *tb_strerror(int err) {
             return "Unsupported terminal";
         case TB_ERR_CAP_COLLISION:
             return "Termcaps collision";
+        case TB_ERR_WOULD_BLOCK:
+            return "Output would block";
         case TB_ERR_RESIZE_SSCANF:
             return "Terminal width/height not received by sscanf() after "
                    "resize";
@@ -1914,14 +3062,28 @@ static int tb_reset(void) {
     global.height = -1;
     global.cursor_x = -1;
     global.cursor_y = -1;
-    global.last_x = -1;
-    global.last_y = -1;
+    enc->last_x = -1;
+    enc->last_y = -1;
     global.fg = TB_DEFAULT;
     global.bg = TB_DEFAULT;
-    global.last_fg = ~global.fg;
-    global.last_bg = ~global.bg;
+    enc->last_fg = ~global.fg;
+    enc->last_bg = ~global.bg;
     global.input_mode = TB_INPUT_ESC;
     global.output_mode = TB_OUTPUT_NORMAL;
+    global.present_mode = TB_PRESENT_NORMAL;
+    global.sync_mode = TB_SYNC_AUTO;
+    global.flush_mode = TB_FLUSH_BLOCKING;
+    global.wfd_flags = -1;
+    global.draw = &global.back;
+    global.mem_diff = mem_diff_scalar;
+#ifdef TB_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        global.mem_diff = mem_diff_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        global.mem_diff = mem_diff_sse2;
+    }
+#endif
     return TB_OK;
 }
 
@@ -1963,10 +3125,40 @@ int tb_printf_inner(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 }
 
 static int init_term_caps(void) {
+    int rv;
     if (load_terminfo() == TB_OK) {
-        return parse_terminfo_caps();
+        if_err_return(rv, parse_terminfo_caps());
+    } else {
+        global.opt_caps = TB_OPTCAP_BUILTIN;
+        if_err_return(rv, load_builtin_caps());
+    }
+    if (caps_are_ecma_sgr()) {
+        global.opt_caps |= TB_OPTCAP_ECMA_SGR;
+    }
+    return TB_OK;
+}
+
+static int caps_are_ecma_sgr(void) {
+    // Attributes can be switched off individually (SGR 22-27) and colors
+    // reset (SGR 39/49) if the caps that switch them on are the ECMA-48 ones
+    static const struct {
+        int cap;
+        const char *seq;
+    } attr_caps[] = {
+        {TB_CAP_BOLD,      "\x1b[1m"},
+        {TB_CAP_BLINK,     "\x1b[5m"},
+        {TB_CAP_UNDERLINE, "\x1b[4m"},
+        {TB_CAP_ITALIC,    "\x1b[3m"},
+        {TB_CAP_REVERSE,   "\x1b[7m"},
+    };
+    size_t i;
+    for (i = 0; i < sizeof(attr_caps) / sizeof(attr_caps[0]); i++) {
+        const char *cap = global.caps[attr_caps[i].cap];
+        if (*cap != '\0' && strcmp(cap, attr_caps[i].seq) != 0) {
+            return 0;
+        }
     }
-    return load_builtin_caps();
+    return 1;
 }
 
 static int init_cap_trie(void) {
@@ -2096,11 +3288,16 @@ static int init_resize_handler(void) {
 
 static int send_init_escape_codes(void) {
     int rv;
-    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_ENTER_CA]));
+    if_err_return(rv, bytebuf_puts(&enc->out, global.caps[TB_CAP_ENTER_CA]));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_ENTER_KEYPAD]));
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_ENTER_KEYPAD]));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_HIDE_CURSOR]));
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_HIDE_CURSOR]));
+    // Ask for synchronized output support. The reply is handled by
+    // extract_esc_reply(). Terminals that don't know DECRQM may echo part of
+    // it, which the following clear erases.
+    send_literal(rv, TB_HARDCAP_QUERY_SYNC);
+    global.sync_query = 1;
     return TB_OK;
 }
 
@@ -2109,13 +3306,16 @@ static int send_clear(void) {
 
     if_err_return(rv, send_attr(global.fg, global.bg));
     if_err_return(rv,
-        bytebuf_puts(&global.out, global.caps[TB_CAP_CLEAR_SCREEN]));
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_CLEAR_SCREEN]));
+
+    enc->last_x = -1;
+    enc->last_y = -1;
 
     if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
-    if_err_return(rv, bytebuf_flush(&global.out, global.wfd));
+    if_err_return(rv, bytebuf_flush(&enc->out, global.wfd));
 
-    global.last_x = -1;
-    global.last_y = -1;
+    enc->last_x = -1;
+    enc->last_y = -1;
 
     return TB_OK;
 }
@@ -2200,14 +3400,23 @@ static int init_cellbuf(void) {
 }
 
 static int tb_deinit(void) {
+#ifdef TB_OPT_RENDER_THREAD
+    render_stop();
+#ifdef TB_OPT_DIFF_THREADS
+    diff_pool_stop();
+#endif
+#endif
     if (global.caps[0] != NULL && global.wfd >= 0) {
-        bytebuf_puts(&global.out, global.caps[TB_CAP_SHOW_CURSOR]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_CLEAR_SCREEN]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_EXIT_CA]);
-        bytebuf_puts(&global.out, global.caps[TB_CAP_EXIT_KEYPAD]);
-        bytebuf_puts(&global.out, TB_HARDCAP_EXIT_MOUSE);
-        bytebuf_flush(&global.out, global.wfd);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_SHOW_CURSOR]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_SGR0]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_CLEAR_SCREEN]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_EXIT_CA]);
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_EXIT_KEYPAD]);
+        bytebuf_puts(&enc->out, TB_HARDCAP_EXIT_MOUSE);
+        bytebuf_flush(&enc->out, global.wfd);
+    }
+    if (global.wfd_flags >= 0) {
+        fcntl(global.wfd, F_SETFL, global.wfd_flags);
     }
     if (global.ttyfd >= 0) {
         if (global.has_orig_tios) {
@@ -2227,13 +3436,18 @@ static int tb_deinit(void) {
 
     cellbuf_free(&global.back);
     cellbuf_free(&global.front);
+#ifdef TB_OPT_EGC
+    cluster_sweep(1);
+#endif
+    view_free();
     bytebuf_free(&global.in);
-    bytebuf_free(&global.out);
+    bytebuf_free(&enc->out);
 
     if (global.terminfo)
         tb_free(global.terminfo);
 
     cap_trie_deinit(&global.cap_trie);
+    row_cache_trim(0);
 
     tb_reset();
     return TB_OK;
@@ -2397,6 +3611,19 @@ static int parse_terminfo_caps(void) {
         global.caps[i] = cap;
     }
 
+    global.opt_caps =
+        probe_terminfo_opt_caps(pos_str_offsets, header[5], header[4]);
+
+    // Booleans are a byte each, right after the names section.
+    // auto_right_margin is the 1st and back_color_erase the 28th.
+    const char *bools = global.terminfo + (6 * sizeof(int16_t)) + header[1];
+    if (header[2] > 1 && bools[1] == 1) {
+        global.opt_caps |= TB_OPTCAP_AM;
+    }
+    if (header[2] > 28 && bools[28] == 1) {
+        global.opt_caps |= TB_OPTCAP_BCE;
+    }
+
     return TB_OK;
 }
 
@@ -2434,6 +3661,28 @@ static int load_builtin_caps(void) {
     return TB_ERR_UNSUPPORTED_TERM;
 }
 
+static int probe_terminfo_opt_caps(int16_t str_offsets_pos,
+    int16_t str_table_len, int16_t nstrs) {
+    int opt_caps = 0;
+    size_t i;
+    for (i = 0; i < sizeof(terminfo_opt_caps) / sizeof(terminfo_opt_caps[0]);
+         i++)
+    {
+        int16_t str_index = terminfo_opt_caps[i].index;
+        size_t pos = (size_t)str_offsets_pos + str_index * sizeof(int16_t);
+        if (str_index >= nstrs || pos + sizeof(int16_t) > global.nterminfo) {
+            // Older terminfo with fewer strings
+            continue;
+        }
+        // Absent (-1) and cancelled (-2) strings have negative offsets
+        const int16_t *str_offset = (int16_t *)(global.terminfo + pos);
+        if (*str_offset >= 0 && *str_offset < str_table_len) {
+            opt_caps |= terminfo_opt_caps[i].flag;
+        }
+    }
+    return opt_caps;
+}
+
 static const char *get_terminfo_string(int16_t str_offsets_pos,
     int16_t str_table_pos, int16_t str_table_len, int16_t str_index) {
     const int16_t *str_offset =
@@ -2460,10 +3709,33 @@ static int wait_event(struct tb_event *event, int timeout) {
 
     fd_set fds;
     struct timeval tv;
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = (timeout - (tv.tv_sec * 1000)) * 1000;
+    int nreplies;
+    int64_t deadline = monotonic_us() + (int64_t)timeout * 1000;
+
+    for (;;) {
+        int64_t wait_us = timeout < 0 ? -1 : deadline - monotonic_us();
+        if (timeout >= 0 && wait_us < 0) {
+            wait_us = 0;
+        }
+
+        // Send a frame held back by tb_present() when it's due, and wake up
+        // for that if it isn't yet
+        int frame_wait = 0;
+        if (global.frame_pending) {
+            int64_t due_us = present_due_us();
+            if (due_us <= 0) {
+                rv = present_frame();
+                if (rv != TB_OK && rv != TB_ERR_WOULD_BLOCK) {
+                    return rv;
+                }
+            } else if (wait_us < 0 || due_us < wait_us) {
+                wait_us = due_us;
+                frame_wait = 1;
+            }
+        }
+        tv.tv_sec = (time_t)(wait_us / 1000000);
+        tv.tv_usec = (suseconds_t)(wait_us % 1000000);
 
-    do {
         FD_ZERO(&fds);
         FD_SET(global.rfd, &fds);
         FD_SET(global.resize_pipefd[0], &fds);
@@ -2473,12 +3745,14 @@ static int wait_event(struct tb_event *event, int timeout) {
                         : global.rfd;
 
         int select_rv =
-            select(maxfd + 1, &fds, NULL, NULL, (timeout < 0) ? NULL : &tv);
+            select(maxfd + 1, &fds, NULL, NULL, (wait_us < 0) ? NULL : &tv);
 
         if (select_rv < 0) {
             // Let EINTR/EAGAIN bubble up
             global.last_errno = errno;
             return TB_ERR_POLL;
+        } else if (select_rv == 0 && frame_wait) {
+            continue;
         } else if (select_rv == 0) {
             return TB_ERR_NO_EVENT;
         }
@@ -2500,6 +3774,7 @@ static int wait_event(struct tb_event *event, int timeout) {
             int ignore = 0;
             read(global.resize_pipefd[0], &ignore, sizeof(ignore));
             // TODO Harden against errors encountered mid-resize
+            render_wait();
             if_err_return(rv, update_term_size());
             if_err_return(rv, resize_cellbufs());
             event->type = TB_EVENT_RESIZE;
@@ -2508,11 +3783,14 @@ static int wait_event(struct tb_event *event, int timeout) {
             return TB_OK;
         }
 
+        // Keep waiting if all that arrived was a reply to a query
+        nreplies = global.nreplies;
         memset(event, 0, sizeof(*event));
         if_ok_return(rv, extract_event(event));
-    } while (timeout == -1);
-
-    return rv;
+        if (timeout != -1 && global.nreplies == nreplies) {
+            return rv;
+        }
+    }
 }
 
 static int extract_event(struct tb_event *event) {
@@ -2527,6 +3805,15 @@ static int extract_event(struct tb_event *event) {
         // Escape sequence?
         // In TB_INPUT_ESC, skip if the buffer is a single escape char
         if (!((global.input_mode & TB_INPUT_ESC) && in->len == 1)) {
+            if_ok_or_need_more_return(rv, extract_esc_user(event, 0));
+
+            // Replies to queries sent by termbox are not events
+            rv = extract_esc_reply();
+            if (rv == TB_OK) {
+                return extract_event(event);
+            } else if (rv == TB_ERR_NEED_MORE) {
+                return rv;
+            }
             if_ok_or_need_more_return(rv, extract_esc(event));
         }
 
@@ -2570,9 +3857,56 @@ static int extract_event(struct tb_event *event) {
     return TB_ERR;
 }
 
+static int extract_esc_reply(void) {
+    // DECRPM, the reply to the DECRQM query sent by send_init_escape_codes():
+    // CSI ? <mode> ; <value> $ y. Replies to queries the caller sent with
+    // tb_send() are left to it, as is any once ours was answered.
+    struct bytebuf_t *in = &global.in;
+    const char *prefix = "\x1b[?";
+    size_t i, n = in->len;
+    int mode = 0, value = 0;
+
+    if (!global.sync_query) {
+        return TB_ERR;
+    }
+    for (i = 0; i < 3; i++) {
+        if (i == n) {
+            return TB_ERR_NEED_MORE;
+        } else if (in->buf[i] != prefix[i]) {
+            return TB_ERR;
+        }
+    }
+    for (; i < n && in->buf[i] >= '0' && in->buf[i] <= '9'; i++) {
+        mode = mode < 100000 ? mode * 10 + (in->buf[i] - '0') : mode;
+    }
+    if (i < n && in->buf[i] == ';') {
+        for (i++; i < n && in->buf[i] >= '0' && in->buf[i] <= '9'; i++) {
+            value = value < 100000 ? value * 10 + (in->buf[i] - '0') : value;
+        }
+    }
+    if (i < n && in->buf[i] != '$') {
+        return TB_ERR;
+    } else if (i + 1 < n && in->buf[i + 1] != 'y') {
+        return TB_ERR;
+    } else if (i + 1 >= n) {
+        return TB_ERR_NEED_MORE;
+    }
+
+    if (mode != 2026) {
+        return TB_ERR;
+    }
+
+    // 0 means not recognized, 1-4 are set/reset (permanently)
+    render_wait();
+    global.has_sync = value >= 1 && value <= 4;
+    global.sync_query = 0;
+    global.nreplies++;
+    bytebuf_shift(in, i + 2);
+    return TB_OK;
+}
+
 static int extract_esc(struct tb_event *event) {
     int rv;
-    if_ok_or_need_more_return(rv, extract_esc_user(event, 0));
     if_ok_or_need_more_return(rv, extract_esc_cap(event));
     if_ok_or_need_more_return(rv, extract_esc_mouse(event));
     if_ok_or_need_more_return(rv, extract_esc_user(event, 1));
@@ -2807,12 +4141,26 @@ static int extract_esc_mouse(struct tb_event *event) {
 
 static int resize_cellbufs(void) {
     int rv;
+    // tb_cell_buffer() makes a new copy of the resized back buffer
+    if_err_return(rv, view_store());
+    view_free();
     if_err_return(rv,
         cellbuf_resize(&global.back, global.width, global.height));
+#ifdef TB_OPT_RENDER_THREAD
+    if (global.render.running) {
+        if_err_return(rv, cellbuf_resize(&global.render.next, global.width,
+                              global.height));
+        if_err_return(rv, cellbuf_resize(&global.render.cells, global.width,
+                              global.height));
+    }
+#endif
     if_err_return(rv,
         cellbuf_resize(&global.front, global.width, global.height));
     if_err_return(rv, cellbuf_clear(&global.front));
+    if_err_return(rv, cellbuf_dirty_all(&global.back));
     if_err_return(rv, send_clear());
+    // Cached rows were sent for the old size
+    row_cache_trim(0);
     return TB_OK;
 }
 
@@ -2822,399 +4170,3063 @@ static void handle_resize(int sig) {
     errno = errno_copy;
 }
 
-static int send_attr(uintattr_t fg, uintattr_t bg) {
+static int present_frame(void) {
     int rv;
 
-    if (fg == global.last_fg && bg == global.last_bg) {
-        return TB_OK;
+    global.frame_time = monotonic_us();
+    global.frame_pending = 0;
+#ifdef TB_OPT_RENDER_THREAD
+    if (global.render.running) {
+        return render_submit();
     }
-
-    if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_SGR0]));
-
-    uintattr_t cfg, cbg;
-    switch (global.output_mode) {
-        default:
-        case TB_OUTPUT_NORMAL:
-            cfg = fg & 0x0f;
-            cbg = bg & 0x0f;
-            break;
-
-        case TB_OUTPUT_256:
-            cfg = fg & 0xff;
-            cbg = bg & 0xff;
-            break;
-
-        case TB_OUTPUT_216:
-            cfg = fg & 0xff;
-            cbg = bg & 0xff;
-            if (cfg > 216)
-                cfg = 216;
-            if (cbg > 216)
-                cbg = 216;
-            cfg += 0x0f;
-            cbg += 0x0f;
-            break;
-
-        case TB_OUTPUT_GRAYSCALE:
-            cfg = fg & 0xff;
-            cbg = bg & 0xff;
-            if (cfg > 24)
-                cfg = 24;
-            if (cbg > 24)
-                cbg = 24;
-            cfg += 0xe7;
-            cbg += 0xe7;
-            break;
-
-#ifdef TB_OPT_TRUECOLOR
-        case TB_OUTPUT_TRUECOLOR:
-            cfg = fg & 0xffffff;
-            cbg = bg & 0xffffff;
-            break;
 #endif
+    rv = present_diff(0, 0, global.front.width, global.front.height);
+    if (enc->stats.deferred) {
+        // Output is still pending, so try again after the next interval
+        global.frame_pending = global.max_fps > 0;
     }
+    return rv;
+}
 
-    uintattr_t attr_bold, attr_blink, attr_italic, attr_underline, attr_reverse,
-        attr_default;
-#ifdef TB_OPT_TRUECOLOR
-    if (global.output_mode == TB_OUTPUT_TRUECOLOR) {
-        attr_bold = TB_TRUECOLOR_BOLD;
-        attr_blink = TB_TRUECOLOR_BLINK;
-        attr_italic = TB_TRUECOLOR_ITALIC;
-        attr_underline = TB_TRUECOLOR_UNDERLINE;
-        attr_reverse = TB_TRUECOLOR_REVERSE;
-        attr_default = TB_TRUECOLOR_DEFAULT;
-    } else
+static void render_wait(void) {
+#ifdef TB_OPT_RENDER_THREAD
+    // Everything but the back buffer belongs to the render thread until it
+    // has presented the frames handed to it
+    struct render_thread_t *r = &global.render;
+    if (!r->running) {
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    while (r->has_frame || r->busy) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
 #endif
-    {
-        attr_bold = TB_BOLD;
-        attr_blink = TB_BLINK;
-        attr_italic = TB_ITALIC;
-        attr_underline = TB_UNDERLINE;
-        attr_reverse = TB_REVERSE;
-        attr_default = TB_DEFAULT;
+}
+
+#ifdef TB_OPT_RENDER_THREAD
+static int render_start(void) {
+    struct render_thread_t *r = &global.render;
+    int rv;
+    if (r->running) {
+        return TB_OK;
     }
 
-    /* For convenience (and some back compat), interpret 0 as default in some
-     * modes */
-    if (global.output_mode == TB_OUTPUT_NORMAL ||
-        global.output_mode == TB_OUTPUT_216 ||
-        global.output_mode == TB_OUTPUT_GRAYSCALE)
+    // The thread presents its own copy of the back buffer. Start it out with
+    // every cell and the changes not presented yet.
+    int w = global.back.width, h = global.back.height;
+    if ((rv = cellbuf_init(&r->next, w, h)) != TB_OK ||
+        (rv = cellbuf_init(&r->cells, w, h)) != TB_OK ||
+        (rv = cellbuf_dirty_all(&global.back)) != TB_OK ||
+        (rv = cellbuf_copy_dirty(&r->cells, &global.back)) != TB_OK)
     {
-        if ((fg & 0xff) == 0)
-            fg |= attr_default;
-        if ((bg & 0xff) == 0)
-            bg |= attr_default;
+        cellbuf_free(&r->next);
+        cellbuf_free(&r->cells);
+        return rv;
+    }
+    if ((rv = pthread_mutex_init(&r->lock, NULL)) != 0 ||
+        (rv = pthread_cond_init(&r->cond, NULL)) != 0
+#ifdef TB_OPT_EGC
+        || (rv = pthread_mutex_init(&global.clusters.lock, NULL)) != 0
+#endif
+    )
+    {
+        global.last_errno = rv;
+        cellbuf_free(&r->next);
+        cellbuf_free(&r->cells);
+        return TB_ERR;
     }
 
-    if (fg & attr_bold)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_BOLD]));
-
-    if (fg & attr_blink)
-        if_err_return(rv, bytebuf_puts(&global.out, global.caps[TB_CAP_BLINK]));
-
-    if (fg & attr_underline)
-        if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_UNDERLINE]));
-
-    if (fg & attr_italic)
-        if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_ITALIC]));
+    r->has_frame = 0;
+    r->busy = 0;
+    r->quit = 0;
+    r->rv = TB_OK;
+    global.draw = &r->cells;
+    if ((rv = pthread_create(&r->thread, NULL, render_main, NULL)) != 0) {
+        global.last_errno = rv;
+        global.draw = &global.back;
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+#ifdef TB_OPT_EGC
+        pthread_mutex_destroy(&global.clusters.lock);
+#endif
+        cellbuf_free(&r->next);
+        cellbuf_free(&r->cells);
+        return TB_ERR;
+    }
+    r->running = 1;
+    return TB_OK;
+}
 
-    if ((fg & attr_reverse) || (bg & attr_reverse))
-        if_err_return(rv,
-            bytebuf_puts(&global.out, global.caps[TB_CAP_REVERSE]));
+static int render_stop(void) {
+    struct render_thread_t *r = &global.render;
+    if (!r->running) {
+        return TB_OK;
+    }
 
-    if_err_return(rv, send_sgr(cfg, cbg, fg & attr_default, bg & attr_default));
+    // The thread presents a frame still handed to it before exiting
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    r->running = 0;
 
-    global.last_fg = fg;
-    global.last_bg = bg;
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+#ifdef TB_OPT_EGC
+    pthread_mutex_destroy(&global.clusters.lock);
+#endif
+    cellbuf_free(&r->next);
+    cellbuf_free(&r->cells);
 
-    return TB_OK;
+    // Compare everything again in case a frame failed part way through
+    global.draw = &global.back;
+    cellbuf_dirty_all(&global.back);
+    return r->rv;
 }
 
-static int send_sgr(uintattr_t cfg, uintattr_t cbg, uintattr_t fg_is_default,
-    uintattr_t bg_is_default) {
+static int render_submit(void) {
+    struct render_thread_t *r = &global.render;
     int rv;
-    char nbuf[32];
 
-    if (fg_is_default && bg_is_default) {
-        return TB_OK;
+    // Changes pile up in next until the thread takes them, so a frame it
+    // didn't get to is merged into this one
+    pthread_mutex_lock(&r->lock);
+    if (r->has_frame) {
+        global.frames_merged++;
+        global.frames_dropped++;
     }
-
-    switch (global.output_mode) {
-        default:
-        case TB_OUTPUT_NORMAL:
-            send_literal(rv, "\x1b[");
-            if (!fg_is_default) {
-                send_literal(rv, "3");
-                send_num(rv, nbuf, cfg - 1);
-                if (!bg_is_default) {
-                    send_literal(rv, ";");
-                }
+    rv = cellbuf_copy_dirty(&r->next, &global.back);
+    r->has_frame = 1;
+    if (rv == TB_OK && r->rv != TB_OK) {
+        // Report an error from an earlier frame
+        rv = r->rv;
+        r->rv = TB_OK;
+    }
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return rv;
+}
+
+static void *render_main(void *arg) {
+    struct render_thread_t *r = &global.render;
+    (void)arg;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->has_frame && !r->quit) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (!r->has_frame) {
+            break;
+        }
+        int rv = cellbuf_copy_dirty(&r->cells, &r->next);
+        r->has_frame = 0;
+        r->busy = 1;
+        pthread_mutex_unlock(&r->lock);
+
+        // Diff and write without the lock so tb_present() can hand off the
+        // next frame meanwhile
+        if (rv == TB_OK) {
+            rv = present_diff(0, 0, global.front.width, global.front.height);
+        }
+        if (rv == TB_ERR_WOULD_BLOCK) {
+            // Still pending, sent along with the next frame or tb_flush()
+            rv = TB_OK;
+        }
+
+        pthread_mutex_lock(&r->lock);
+        r->busy = 0;
+        if (rv != TB_OK && r->rv == TB_OK) {
+            r->rv = rv;
+        }
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+#endif
+
+#ifdef TB_OPT_DIFF_THREADS
+static int diff_pool_start(int nthreads) {
+    struct diff_pool_t *p = &global.diff_pool;
+    int rv, i;
+    size_t size = sizeof(*p->encoders) * nthreads;
+    if (!(p->encoders = tb_malloc(size))) {
+        return TB_ERR_MEM;
+    }
+    memset(p->encoders, 0, size);
+    if ((rv = pthread_mutex_init(&p->lock, NULL)) != 0) {
+        tb_free(p->encoders);
+        p->encoders = NULL;
+        global.last_errno = rv;
+        return TB_ERR;
+    }
+    if ((rv = pthread_cond_init(&p->cond, NULL)) != 0) {
+        pthread_mutex_destroy(&p->lock);
+        tb_free(p->encoders);
+        p->encoders = NULL;
+        global.last_errno = rv;
+        return TB_ERR;
+    }
+    p->gen = 0;
+    p->busy = 0;
+    p->quit = 0;
+    for (i = 0; i < nthreads; i++) {
+        p->ids[i] = i;
+        if ((rv = pthread_create(&p->threads[i], NULL, diff_pool_main,
+                 &p->ids[i])) != 0)
+        {
+            global.last_errno = rv;
+            p->nthreads = i;
+            diff_pool_stop();
+            return TB_ERR;
+        }
+    }
+    p->nthreads = nthreads;
+    return TB_OK;
+}
+
+static int diff_pool_stop(void) {
+    struct diff_pool_t *p = &global.diff_pool;
+    int i;
+    if (!p->encoders) {
+        return TB_OK;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->nthreads; i++) {
+        pthread_join(p->threads[i], NULL);
+        bytebuf_free(&p->encoders[i].out);
+    }
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    tb_free(p->encoders);
+    tb_free(p->rows);
+    p->encoders = NULL;
+    p->rows = NULL;
+    p->nrows = 0;
+    p->nthreads = 0;
+    return TB_OK;
+}
+
+static void *diff_pool_main(void *arg) {
+    struct diff_pool_t *p = &global.diff_pool;
+    int i = *(int *)arg, band = i + 1;
+    int gen = 0, rv;
+
+    enc = &p->encoders[i];
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->gen == gen && !p->quit) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->quit) {
+            break;
+        }
+        gen = p->gen;
+        int h = global.front.height, n = p->nthreads + 1;
+        pthread_mutex_unlock(&p->lock);
+
+        rv = present_band(h * band / n, h * (band + 1) / n);
+
+        pthread_mutex_lock(&p->lock);
+        p->rv[i] = rv;
+        if (--p->busy == 0) {
+            pthread_cond_broadcast(&p->cond);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int present_bands(void) {
+    // Split the rows into one band per thread. This thread encodes the first
+    // band straight into the output, the others encode theirs from an unknown
+    // terminal state into their own. Joining those in order, a row encoded
+    // from the state the rows before it actually leave is taken as is, any
+    // other is encoded again here, so the output is the same as encoding the
+    // rows one by one. A changed row mostly leaves the same state whatever it
+    // was encoded from, so that's usually only the first one of each band.
+    // The front rows are updated once every band is encoded, as the cells
+    // and clusters they hold are looked at until then.
+    struct diff_pool_t *p = &global.diff_pool;
+    int rv, i, y, band, h = global.front.height, n = p->nthreads + 1;
+
+    if (p->nrows < h) {
+        struct band_row_t *rows = tb_realloc(p->rows, sizeof(*rows) * h);
+        if (!rows) {
+            return TB_ERR_MEM;
+        }
+        p->rows = rows;
+        p->nrows = h;
+    }
+    for (i = 0; i < p->nthreads; i++) {
+        struct encoder_t *e = &p->encoders[i];
+        e->out.len = 0;
+        e->out.off = 0;
+        e->last_x = -1;
+        e->last_y = -1;
+        e->last_fg = ~global.fg;
+        e->last_bg = ~global.bg;
+        e->has_last_sgr = 0;
+        memset(&e->stats, 0, sizeof(e->stats));
+    }
+
+    global.present_banded = 1;
+    pthread_mutex_lock(&p->lock);
+    p->gen++;
+    p->busy = p->nthreads;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    rv = present_band(0, h / n);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy > 0) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    for (band = 0; rv == TB_OK && band < n; band++) {
+        struct encoder_t *e = band > 0 ? &p->encoders[band - 1] : enc;
+        int encoded = band > 0 && p->rv[band - 1] == TB_OK;
+        for (y = h * band / n; y < h * (band + 1) / n; y++) {
+            struct cellspan_t *span = &global.draw->dirty[y];
+            struct band_row_t *r = &p->rows[y];
+            if (span->x0 > span->x1) {
+                continue;
             }
-            if (!bg_is_default) {
-                send_literal(rv, "4");
-                send_num(rv, nbuf, cbg - 1);
+
+            struct term_state_t state;
+            term_state_save(&state);
+            if (band == 0 || (encoded && r->len == 0)) {
+                // Sent already, or unchanged
+            } else if (encoded && term_state_eq(&state, &r->from)) {
+                if_err_break(rv,
+                    bytebuf_nputs(&enc->out, &e->out.buf[r->off], r->len));
+                term_state_restore(&r->to);
+                enc->stats.cells += r->cells;
+                enc->stats.cursor_moves += r->cursor_moves;
+                enc->stats.cursor_bytes += r->cursor_bytes;
+                enc->stats.sgr_cache_hits += r->sgr_cache_hits;
+                enc->stats.sgr_cache_misses += r->sgr_cache_misses;
+            } else {
+                size_t start = enc->out.len;
+                if_err_break(rv, present_row(y, span->x0, span->x1));
+                r->len = enc->out.len - start;
             }
-            send_literal(rv, "m");
-            break;
 
-        case TB_OUTPUT_256:
-        case TB_OUTPUT_216:
-        case TB_OUTPUT_GRAYSCALE:
-            send_literal(rv, "\x1b[");
-            if (!fg_is_default) {
-                send_literal(rv, "38;5;");
-                send_num(rv, nbuf, cfg);
-                if (!bg_is_default) {
-                    send_literal(rv, ";");
+            if (r->len > 0 && !global.present_swap) {
+                if_err_break(rv, present_row_commit(y));
+            }
+            span->x0 = global.draw->width;
+            span->x1 = -1;
+        }
+    }
+    global.present_banded = 0;
+    return rv;
+}
+
+static int present_band(int y0, int y1) {
+    // Encode the changed rows of a band into this thread's output, noting
+    // for each one the terminal state it was encoded from and what it sent
+    int rv, y;
+    struct cellbuf_t *back = global.draw;
+    for (y = y0; y < y1; y++) {
+        struct cellspan_t *span = &back->dirty[y];
+        struct band_row_t *r = &global.diff_pool.rows[y];
+        r->len = 0;
+        if (span->x0 > span->x1) {
+            continue;
+        }
+        struct tb_stats stats = enc->stats;
+        term_state_save(&r->from);
+        r->off = enc->out.len;
+        if_err_return(rv, present_row(y, span->x0, span->x1));
+        r->len = enc->out.len - r->off;
+        term_state_save(&r->to);
+        r->cells = enc->stats.cells - stats.cells;
+        r->cursor_moves = enc->stats.cursor_moves - stats.cursor_moves;
+        r->cursor_bytes = enc->stats.cursor_bytes - stats.cursor_bytes;
+        r->sgr_cache_hits = enc->stats.sgr_cache_hits - stats.sgr_cache_hits;
+        r->sgr_cache_misses =
+            enc->stats.sgr_cache_misses - stats.sgr_cache_misses;
+    }
+    return TB_OK;
+}
+#endif
+
+static int present_diff(int x, int y, int w, int h) {
+    int rv;
+
+    // TODO Assert global.draw->(width,height) == global.front.(width,height)
+
+    memset(&enc->stats, 0, sizeof(enc->stats));
+    if (global.flush_mode == TB_FLUSH_COALESCE && enc->out.len > 0) {
+        // Leave the changes in the back buffer until the terminal has taken
+        // the previous frame
+        rv = bytebuf_flush_nonblock(&enc->out, global.wfd);
+        if (rv != TB_OK) {
+            enc->stats.deferred = 1;
+            enc->stats.pending = enc->out.len - enc->out.off;
+            return rv;
+        }
+    }
+    size_t out_start = enc->out.len;
+
+    // With TB_PRESENT_REDRAW, a frame sent whole leaves the front buffer as
+    // is until it's swapped with the back buffer afterwards
+    global.present_swap = (global.present_mode & TB_PRESENT_REDRAW) &&
+                          global.present_budget == 0 && x == 0 && y == 0 &&
+                          w == global.front.width && h == global.front.height;
+    rv = present_encode(x, y, w, h);
+    if (global.present_swap) {
+        global.present_swap = 0;
+        if (rv == TB_OK) {
+            rv = present_swap();
+        } else {
+            // Bring the front rows that were sent up to date one by one
+            int ry;
+            for (ry = 0; ry < global.front.height; ry++) {
+                struct cellspan_t *span = &global.draw->dirty[ry];
+                if (span->x0 > span->x1) {
+                    present_row_commit(ry);
                 }
             }
-            if (!bg_is_default) {
-                send_literal(rv, "48;5;");
-                send_num(rv, nbuf, cbg);
+        }
+    }
+    if (rv != TB_OK) {
+        return rv;
+    }
+    enc->stats.bytes = enc->out.len - out_start;
+
+    if (global.flush_mode == TB_FLUSH_BLOCKING) {
+        rv = bytebuf_flush(&enc->out, global.wfd);
+    } else {
+        rv = bytebuf_flush_nonblock(&enc->out, global.wfd);
+    }
+    enc->stats.pending = enc->out.len - enc->out.off;
+
+    return rv;
+}
+
+static int present_encode(int x, int y, int w, int h) {
+    // Appends the changes in the given rectangle to the output buffer,
+    // updating the front buffer to match
+    int rv;
+    int full = x == 0 && y == 0 && w == global.front.width &&
+               h == global.front.height;
+
+    enc->last_x = -1;
+    enc->last_y = -1;
+
+    size_t out_start = enc->out.len;
+    int sync = global.sync_mode == TB_SYNC_ON ||
+               (global.sync_mode == TB_SYNC_AUTO && global.has_sync);
+    if (sync) {
+        send_literal(rv, TB_HARDCAP_BEGIN_SYNC);
+    }
+    size_t frame_start = enc->out.len;
+
+    if (full) {
+        if_err_return(rv, present_rows(frame_start));
+    } else {
+        // Scrolling or repainting would touch the rest of the screen
+        if_err_return(rv, present_rows_region(x, y, x + w - 1, y + h - 1));
+    }
+
+    // The front rows are up to date again
+    enc->erased_n = 0;
+    if_err_return(rv, send_cursor_if(global.cursor_x, global.cursor_y));
+    if (sync && enc->out.len == frame_start) {
+        // Nothing to synchronize
+        enc->out.len = out_start;
+    } else if (sync) {
+        send_literal(rv, TB_HARDCAP_END_SYNC);
+        enc->stats.synchronized = 1;
+    }
+    return TB_OK;
+}
+
+static int present_estimate(struct tb_present_cost *cost) {
+    // Encode the frame as tb_present() would, then put back everything that
+    // changed: the front rows it may have touched and their hashes, the
+    // changes it presented, the terminal state, the stats and the output
+    // buffer. The row cache is left out so the counts are those of encoding
+    // every row.
+    int rv, i, x, y;
+    int w = global.front.width, h = global.front.height;
+    int all_rows = global.present_mode &
+                   (TB_PRESENT_SCROLL | TB_PRESENT_REPAINT);
+
+    int nrows = 0;
+    for (y = 0; y < h; y++) {
+        if (all_rows || global.draw->dirty[y].x0 <= global.draw->dirty[y].x1) {
+            nrows++;
+        }
+    }
+    struct cellspan_t *dirty = tb_malloc(sizeof(*dirty) * h * 2);
+    uint32_t *hashes = tb_malloc(sizeof(*hashes) * h);
+    struct cellbuf_t rows;
+    if (!dirty || !hashes ||
+        cellbuf_init(&rows, w, nrows ? nrows : 1) != TB_OK)
+    {
+        tb_free(dirty);
+        tb_free(hashes);
+        return TB_ERR_MEM;
+    }
+    memcpy(dirty, global.draw->dirty, sizeof(*dirty) * h);
+    memcpy(&dirty[h], global.front.dirty, sizeof(*dirty) * h);
+    memcpy(hashes, global.front.hashes, sizeof(*hashes) * h);
+    for (i = 0, y = 0; y < h; y++) {
+        if (all_rows || dirty[y].x0 <= dirty[y].x1) {
+            for (x = 0; x < w; x++, i++) {
+                cell_copy(&rows, i, &global.front, y * w + x);
             }
-            send_literal(rv, "m");
-            break;
+        }
+    }
 
-#ifdef TB_OPT_TRUECOLOR
-        case TB_OUTPUT_TRUECOLOR:
-            send_literal(rv, "\x1b[");
-            if (!fg_is_default) {
-                send_literal(rv, "38;2;");
-                send_num(rv, nbuf, (cfg >> 16) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, (cfg >> 8) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, cfg & 0xff);
-                if (!bg_is_default) {
-                    send_literal(rv, ";");
-                }
+    struct term_state_t term;
+    struct tb_stats stats = enc->stats;
+    size_t out_len = enc->out.len;
+    size_t row_cache_max = global.row_cache.max_size;
+    term_state_save(&term);
+    memset(&enc->stats, 0, sizeof(enc->stats));
+    global.row_cache.max_size = 0;
+
+    rv = present_encode(0, 0, w, h);
+    cost->bytes = enc->out.len - out_len;
+    cost->cells = enc->stats.cells;
+    cost->cursor_moves = enc->stats.cursor_moves;
+    cost->sgr_changes =
+        enc->stats.sgr_cache_hits + enc->stats.sgr_cache_misses;
+    cost->rows_left = enc->stats.rows_left;
+
+    enc->out.len = out_len;
+    global.row_cache.max_size = row_cache_max;
+    enc->stats = stats;
+    term_state_restore(&term);
+    memcpy(global.draw->dirty, dirty, sizeof(*dirty) * h);
+    memcpy(global.front.dirty, &dirty[h], sizeof(*dirty) * h);
+    memcpy(global.front.hashes, hashes, sizeof(*hashes) * h);
+    for (i = 0, y = 0; y < h; y++) {
+        if (all_rows || dirty[y].x0 <= dirty[y].x1) {
+            for (x = 0; x < w; x++, i++) {
+                cell_copy(&global.front, y * w + x, &rows, i);
             }
-            if (!bg_is_default) {
-                send_literal(rv, "48;2;");
-                send_num(rv, nbuf, (cbg >> 16) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, (cbg >> 8) & 0xff);
-                send_literal(rv, ";");
-                send_num(rv, nbuf, cbg & 0xff);
+        }
+    }
+    tb_free(dirty);
+    tb_free(hashes);
+    cellbuf_free(&rows);
+    return rv;
+}
+
+static int present_rows(size_t frame_start) {
+    int rv, y;
+
+    if (global.present_mode & TB_PRESENT_SCROLL) {
+        if_err_return(rv, present_scroll());
+    }
+    if (global.present_mode & TB_PRESENT_REPAINT) {
+        if_err_return(rv, present_repaint());
+    }
+
+    if (global.present_budget > 0) {
+        if_err_return(rv, present_rows_budget(frame_start));
+#ifdef TB_OPT_DIFF_THREADS
+    } else if (global.diff_pool.nthreads > 0) {
+        if_err_return(rv, present_bands());
+#endif
+    } else {
+        for (y = 0; y < global.front.height; y++) {
+            struct cellspan_t *span = &global.draw->dirty[y];
+            if (span->x0 > span->x1) {
+                continue;
             }
-            send_literal(rv, "m");
+            if_err_return(rv, present_row_cached(y, span->x0, span->x1));
+            span->x0 = global.draw->width;
+            span->x1 = -1;
+        }
+    }
+    return TB_OK;
+}
+
+static int present_rows_region(int x0, int y0, int x1, int y1) {
+    int rv, y;
+    struct cellbuf_t *back = global.draw, *front = &global.front;
+    for (y = y0; y <= y1; y++) {
+        struct cellspan_t *span = &back->dirty[y];
+        int row = y * front->width;
+
+        // Take in wide cells straddling the edges, on the terminal or in the
+        // back buffer, since half of one can't be drawn
+        int rx0 = x0, rx1 = x1;
+        if (rx0 > 0 && (cell_ch(front, row + rx0) == TB_SHADOW_CH ||
+                           cell_width(back, row + rx0 - 1) > 1))
+        {
+            rx0--;
+        }
+        if (rx1 + 1 < front->width &&
+            cell_ch(front, row + rx1 + 1) == TB_SHADOW_CH)
+        {
+            rx1++;
+        }
+
+        int sx0 = span->x0 > rx0 ? span->x0 : rx0;
+        int sx1 = span->x1 < rx1 ? span->x1 : rx1;
+        if (sx0 > sx1) {
+            continue;
+        }
+        if_err_return(rv, present_row(y, sx0, sx1));
+        if (sx0 == span->x0 && sx1 == span->x1) {
+            span->x0 = back->width;
+            span->x1 = -1;
+        }
+        // Otherwise leave the span as is. The cells just sent now match the
+        // front buffer, so the next present only compares them again.
+    }
+    return TB_OK;
+}
+
+static int present_row(int y, int x0, int x1) {
+    int rv, x, i;
+    uint32_t shadow = TB_SHADOW_CH;
+
+    struct cellbuf_t *back = global.draw, *front = &global.front;
+    int row = y * front->width;
+    uint8_t *wrow = &back->widths[row];
+
+    // The front row's hash is redone before it's next looked at
+    cellbuf_dirty(front, 0, y, front->width - 1, y);
+    enc->erased_n = 0;
+
+    // Cells left of the span are unchanged, so a column covered by a wide
+    // cell there is still covered
+    x = x0;
+    while (x < front->width && cell_ch(front, row + x) == TB_SHADOW_CH) {
+        x++;
+    }
+
+    while (x < front->width && x <= x1) {
+        // Jump to the next cell that differs from the front buffer. If
+        // that column is covered by an unchanged wide cell, resume after
+        // the covered columns instead.
+        int d = x + cell_run_cmp(back, row + x, front, row + x, x1 - x + 1);
+        if (d > x1) {
             break;
+        } else if (d > x && cell_ch(front, row + d) == TB_SHADOW_CH) {
+            for (x = d + 1; x < front->width &&
+                            cell_ch(front, row + x) == TB_SHADOW_CH;
+                 x++)
+                ;
+            continue;
+        }
+        x = d;
+
+        int w = wrow[x];
+        if (w == 0) {
+            // Not cached, e.g., written via tb_cell_buffer()
+            w = wrow[x] = cell_width(back, row + x);
+        }
+
+        // A changed cell may have changed width, shifting where the
+        // following cells start. Keep comparing until a cell matches.
+        if (x + w > x1) {
+            x1 = x + w;
+        }
+
+        int nrun;
+        if (w == 1) {
+            if_err_return(rv, send_run(x, y, x1, &nrun));
+            if (nrun > 0) {
+                x += nrun;
+                continue;
+            }
+        }
+
+        uintattr_t fg = cell_fg(back, row + x), bg = cell_bg(back, row + x);
+        send_attr(fg, bg);
+        if (w > 1 && x >= front->width - (w - 1)) {
+            for (i = x; i < front->width; i++) {
+                send_char(i, y, ' ', 1);
+            }
+        } else {
+#ifdef TB_OPT_EGC
+            struct cluster_t *c = cluster_find(cell_ch(back, row + x));
+            if (c)
+                send_cluster(x, y, c->ch, c->nch, w);
+            else
 #endif
+                send_char(x, y, cell_ch(back, row + x), w);
+        }
+
+        // The cells sent aren't looked at again in this row, except cells
+        // erased ahead of the cursor, which motion_cells() takes from the
+        // back buffer. So updating the front row can be left to
+        // present_swap() or present_bands().
+        if (!global.present_swap && !global.present_banded) {
+            if_err_return(rv, cell_copy(front, row + x, back, row + x));
+            for (i = 1; i < w && x + i < front->width; i++) {
+                if_err_return(rv,
+                    cell_set(front, row + x + i, &shadow, 1, fg, bg));
+            }
+        }
+        x += w;
     }
     return TB_OK;
 }
 
-static int send_cursor_if(int x, int y) {
+static int present_row_cached(int y, int x0, int x1) {
+    // A row that changed whole is looked up by its back and front cells and
+    // the terminal state before it. On a hit, the bytes sent for the same
+    // change earlier are sent again instead of encoding the row.
     int rv;
-    char nbuf[32];
-    if (x < 0 || y < 0) {
+    struct cellbuf_t *back = global.draw, *front = &global.front;
+    int w = front->width, row = y * w;
+    size_t nkeys = (size_t)w * TB_CELL_KEY_LEN;
+
+    if (x0 > 0 || x1 < w - 1 ||
+        sizeof(struct row_cache_entry_t) + 2 * nkeys >
+            global.row_cache.max_size)
+    {
+        return present_row(y, x0, x1);
+    } else if (cell_run_cmp(back, row, front, row, w) == w) {
+        return TB_OK;
+    }
+#ifdef TB_OPT_EGC
+    // Cluster ids are reused once freed, so they can't be part of the keys
+    int x;
+    for (x = 0; x < w; x++) {
+        if (cell_has_cluster(back, row + x) ||
+            cell_has_cluster(front, row + x))
+        {
+            return present_row(y, x0, x1);
+        }
+    }
+#endif
+
+    struct term_state_t from;
+    term_state_save(&from);
+    if_err_return(rv, cellbuf_hash_rows(back, y, y));
+    if_err_return(rv, cellbuf_hash_rows(front, y, y));
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ back->hashes[y]) * 16777619u;
+    hash = (hash ^ front->hashes[y]) * 16777619u;
+    hash = (hash ^ (uint32_t)y) * 16777619u;
+    hash = (hash ^ (uint32_t)from.last_x) * 16777619u;
+    hash = (hash ^ (uint32_t)from.last_y) * 16777619u;
+    hash = (hash ^ (uint32_t)from.last_fg) * 16777619u;
+    hash = (hash ^ (uint32_t)from.last_bg) * 16777619u;
+
+    struct row_cache_entry_t *e = row_cache_find(hash, y, &from);
+    if (e) {
+        if_err_return(rv,
+            bytebuf_nputs(&enc->out, &e->data[2 * nkeys], e->len));
+        term_state_restore(&e->to);
+        enc->stats.cells += e->cells;
+        enc->stats.cursor_moves += e->cursor_moves;
+        enc->stats.cursor_bytes += e->cursor_bytes;
+        enc->stats.row_cache_hits++;
+        return global.present_swap ? TB_OK : present_row_commit(y);
+    }
+
+    // The keys are taken before present_row() updates the front row. If
+    // there's no memory for an entry, the row is simply not cached.
+    e = tb_malloc(sizeof(*e) + 2 * nkeys);
+    if (!e) {
+        return present_row(y, x0, x1);
+    }
+    cellbuf_row_key(back, y, e->data);
+    cellbuf_row_key(front, y, &e->data[nkeys]);
+    size_t start = enc->out.len;
+    struct tb_stats stats = enc->stats;
+    rv = present_row(y, x0, x1);
+    enc->stats.row_cache_misses++;
+
+    size_t len = enc->out.len - start;
+    size_t size = sizeof(*e) + 2 * nkeys + len;
+    struct row_cache_entry_t *grown = NULL;
+    if (rv == TB_OK && size <= global.row_cache.max_size) {
+        grown = tb_realloc(e, size);
+    }
+    if (!grown) {
+        tb_free(e);
+        return rv;
+    }
+    e = grown;
+    e->size = size;
+    e->hash = hash;
+    e->y = y;
+    e->width = w;
+    e->from = from;
+    term_state_save(&e->to);
+    e->cells = enc->stats.cells - stats.cells;
+    e->cursor_moves = enc->stats.cursor_moves - stats.cursor_moves;
+    e->cursor_bytes = enc->stats.cursor_bytes - stats.cursor_bytes;
+    e->len = len;
+    memcpy(&e->data[2 * nkeys], &enc->out.buf[start], len);
+    row_cache_add(e);
+    return TB_OK;
+}
+
+static int present_row_commit(int y) {
+    // Update the front row as present_row() does when it sends the whole row:
+    // each cell of the back row, with the columns covered by a wide cell
+    // holding shadow cells
+    int rv, x, i, w;
+    uint32_t shadow = TB_SHADOW_CH;
+    struct cellbuf_t *back = global.draw, *front = &global.front;
+    int row = y * front->width;
+    uint8_t *wrow = &back->widths[row];
+
+    cellbuf_dirty(front, 0, y, front->width - 1, y);
+    for (x = 0; x < front->width; x += w) {
+        w = wrow[x];
+        if (w == 0) {
+            w = wrow[x] = cell_width(back, row + x);
+        }
+        if (cell_cmp(front, row + x, back, row + x) != 0) {
+            if_err_return(rv, cell_copy(front, row + x, back, row + x));
+        }
+        for (i = 1; i < w && x + i < front->width; i++) {
+            if_err_return(rv,
+                cell_set(front, row + x + i, &shadow, 1,
+                    cell_fg(back, row + x), cell_bg(back, row + x)));
+        }
+    }
+    return TB_OK;
+}
+
+static int present_swap(void) {
+    // Every cell of the back buffer has been sent, so it becomes the front
+    // buffer, with the columns covered by a wide cell holding shadow cells
+    // again. The old front cells are left for the caller to redraw over.
+    int rv, x, y, i, w;
+    uint32_t shadow = TB_SHADOW_CH;
+    struct cellbuf_t *back = global.draw, *front = &global.front;
+    cellbuf_swap_cells(front, back);
+
+    for (y = 0; y < front->height; y++) {
+        int row = y * front->width;
+        uint8_t *wrow = &back->widths[row];
+        for (x = 0; x < front->width; x += w) {
+            w = wrow[x];
+            if (w == 0) {
+                w = cell_width(front, row + x);
+            }
+            for (i = 1; i < w && x + i < front->width; i++) {
+                if_err_return(rv,
+                    cell_set(front, row + x + i, &shadow, 1,
+                        cell_fg(front, row + x), cell_bg(front, row + x)));
+            }
+        }
+    }
+    // Widths are cached for the back cells
+    memset(back->widths, 0, (size_t)back->width * back->height);
+    if (back == &global.back) {
+        view_load(0, back->width * back->height);
+    }
+    return cellbuf_dirty_all(front);
+}
+
+static int present_rows_budget(size_t frame_start) {
+    // Send what the user is looking at first: the priority rect if set, else
+    // the rows around the cursor. Then go top to bottom until the budget is
+    // spent, leaving the remaining rows dirty for a later present.
+    int rv, y;
+    int px0 = 0, px1 = global.front.width - 1, py0 = 0, py1 = -1;
+    if (global.priority_w > 0 && global.priority_h > 0) {
+        px0 = global.priority_x;
+        px1 = global.priority_x + global.priority_w - 1;
+        py0 = global.priority_y;
+        py1 = global.priority_y + global.priority_h - 1;
+    } else if (global.cursor_y >= 0) {
+        py0 = global.cursor_y - TB_BUDGET_CURSOR_ROWS;
+        py1 = global.cursor_y + TB_BUDGET_CURSOR_ROWS;
+    }
+    py0 = py0 < 0 ? 0 : py0;
+    py1 = py1 >= global.front.height ? global.front.height - 1 : py1;
+
+    for (y = py0; y <= py1; y++) {
+        struct cellspan_t *span = &global.draw->dirty[y];
+        int x0 = span->x0 > px0 ? span->x0 : px0;
+        int x1 = span->x1 < px1 ? span->x1 : px1;
+        if (x0 > x1) {
+            continue;
+        } else if (enc->out.len - frame_start >= global.present_budget) {
+            break;
+        }
+        // The sent cells now match the front buffer, so leaving the span as
+        // is only costs comparing them again below
+        if_err_return(rv, present_row(y, x0, x1));
+    }
+
+    for (y = 0; y < global.front.height; y++) {
+        struct cellspan_t *span = &global.draw->dirty[y];
+        if (span->x0 > span->x1) {
+            continue;
+        } else if (enc->stats.rows_left > 0 ||
+                   enc->out.len - frame_start >= global.present_budget)
+        {
+            enc->stats.rows_left++;
+            continue;
+        }
+        if_err_return(rv, present_row_cached(y, span->x0, span->x1));
+        span->x0 = global.draw->width;
+        span->x1 = -1;
+    }
+    return TB_OK;
+}
+
+static int present_scroll(void) {
+    int rv, y, fy, i;
+    int h = global.draw->height;
+    uint32_t *bh = global.draw->hashes;
+    uint32_t *fh = global.front.hashes;
+
+    // Nothing moved unless some row changed
+    for (y = 0; y < h && global.draw->dirty[y].x0 > global.draw->dirty[y].x1; y++)
+        ;
+    if (y >= h) {
         return TB_OK;
     }
-    send_literal(rv, "\x1b[");
-    send_num(rv, nbuf, y + 1);
-    send_literal(rv, ";");
-    send_num(rv, nbuf, x + 1);
-    send_literal(rv, "H");
+
+    // Only rows that changed are hashed again. The front buffer's dirty spans
+    // mark the rows sent since they were last hashed, and the back rows that
+    // didn't change are left as they are on the terminal.
+    for (y = 0; y < h; y++) {
+        struct cellspan_t *span = &global.front.dirty[y];
+        if (span->x0 <= span->x1) {
+            if_err_return(rv, cellbuf_hash_rows(&global.front, y, y));
+            span->x0 = global.front.width;
+            span->x1 = -1;
+        }
+    }
+    for (y = 0; y < h; y++) {
+        struct cellspan_t *span = &global.draw->dirty[y];
+        if (span->x0 <= span->x1) {
+            if_err_return(rv, cellbuf_hash_rows(global.draw, y, y));
+        } else {
+            bh[y] = fh[y];
+        }
+    }
+
+    // Exposed rows are filled by the terminal using the default colors
+    uintattr_t attr_default = TB_DEFAULT;
+#ifdef TB_OPT_TRUECOLOR
+    if (global.output_mode == TB_OUTPUT_TRUECOLOR) {
+        attr_default = TB_TRUECOLOR_DEFAULT;
+    }
+#endif
+
+    for (;;) {
+        // Find the block of back rows [best_y, best_y + best_len) that is in
+        // the front buffer best_shift rows away and whose scroll saves the
+        // most rows from being redrawn. Rows with equal hashes at the same y
+        // are taken as already correct. Uniform rows (e.g., blank ones) are
+        // cheap to redraw and match almost anywhere, so they don't count.
+        int best_gain = 0, best_y = 0, best_len = 0, best_shift = 0;
+        for (y = 0; y < h; y++) {
+            if (bh[y] == fh[y] || cellbuf_row_uniform(global.draw, y)) {
+                continue;
+            }
+            for (fy = 0; fy < h; fy++) {
+                if (fy == y || fh[fy] != bh[y] ||
+                    (y > 0 && fy > 0 && bh[y - 1] != fh[y - 1] &&
+                        bh[y - 1] == fh[fy - 1]) ||
+                    !cellbuf_row_eq(global.draw, y, &global.front, fy))
+                {
+                    // No match, or not the start of a block
+                    continue;
+                }
+                int len = 1, gain = 1;
+                while (y + len < h && fy + len < h &&
+                       bh[y + len] == fh[fy + len] &&
+                       cellbuf_row_eq(global.draw, y + len, &global.front,
+                           fy + len))
+                {
+                    if (bh[y + len] != fh[y + len] &&
+                        !cellbuf_row_uniform(global.draw, y + len))
+                    {
+                        gain++;
+                    }
+                    len++;
+                }
+
+                // Exposed rows are blanked, so those that were correct
+                // already would have to be redrawn
+                int shift = fy - y;
+                int ey0 = shift > 0 ? y + len : fy;
+                int ey1 = shift > 0 ? fy + len - 1 : y - 1;
+                for (i = ey0; i <= ey1; i++) {
+                    if (bh[i] == fh[i]) {
+                        gain--;
+                    }
+                }
+
+                if (gain > best_gain) {
+                    best_gain = gain;
+                    best_y = y;
+                    best_len = len;
+                    best_shift = shift;
+                }
+            }
+        }
+
+        if (best_gain <= 0) {
+            break;
+        }
+
+        int top = best_shift > 0 ? best_y : best_y + best_shift;
+        int bot = best_shift > 0 ? best_y + best_shift + best_len - 1
+                                 : best_y + best_len - 1;
+        if_err_return(rv, send_attr(attr_default, attr_default));
+        if_err_return(rv, send_scroll(top, bot, best_shift));
+        if_err_return(rv, cellbuf_scroll(&global.front, top, bot, best_shift,
+                              attr_default, attr_default));
+        if_err_return(rv, cellbuf_dirty(global.draw, 0, top,
+                              global.draw->width - 1, bot));
+    }
+
+    return TB_OK;
+}
+
+static int present_repaint(void) {
+    // Clear the screen and reset the front buffer to match if that is
+    // estimated to be cheaper than updating the changed cells, which are then
+    // all that's left to send. Both are taken to cost a byte per cell sent
+    // and a few per attribute change. Updating sends changed cells except
+    // blanks that can be erased, plus a cursor jump per run of them (less
+    // across short gaps or an autowrap). A repaint sends the cells of each
+    // row up to the last visible one, plus a line feed.
+    int rv, x, y, i;
+    struct cellbuf_t *back = global.draw, *front = &global.front;
+    int w = front->width, h = front->height;
+    int erase = global.opt_caps & (TB_OPTCAP_ECH | TB_OPTCAP_EL);
+    int last = -1;
+
+    size_t cost_diff = 0;
+    int end = -1;
+    for (y = 0; y < h; y++) {
+        struct cellspan_t *span = &back->dirty[y];
+        int row = y * w;
+        int wrap = end == w && (global.opt_caps & TB_OPTCAP_AM);
+        end = -1;
+        x = span->x0;
+        while (x <= span->x1) {
+            int d = x + cell_run_cmp(back, row + x, front, row + x,
+                            span->x1 - x + 1);
+            if (d > span->x1) {
+                break;
+            }
+            if (d == 0 && wrap) {
+                // Continued from the previous row
+            } else if (end >= 0 && d - end < TB_REPAINT_JUMP_COST) {
+                // Crossed by re-printing or a relative move
+                cost_diff += (size_t)(d - end);
+            } else {
+                cost_diff += TB_REPAINT_JUMP_COST;
+            }
+            for (x = d; x <= span->x1 &&
+                        cell_cmp(back, row + x, front, row + x) != 0;
+                 x++)
+            {
+                if (last >= 0 &&
+                    (cell_fg(back, last) != cell_fg(back, row + x) ||
+                        cell_bg(back, last) != cell_bg(back, row + x)))
+                {
+                    cost_diff += TB_REPAINT_ATTR_COST;
+                }
+                last = row + x;
+                cost_diff += !(erase && cell_is_erasable(back, row + x));
+            }
+            end = x;
+        }
+    }
+
+    size_t cost_repaint = strlen(global.caps[TB_CAP_CLEAR_SCREEN]);
+    last = -1;
+    for (y = 0; y < h && cost_repaint < cost_diff; y++) {
+        int row = y * w;
+        for (end = w; end > 0 && cell_is_blank(back, row + end - 1, 1); end--)
+            ;
+        for (x = 0; x < end; x++) {
+            if (last >= 0 &&
+                (cell_fg(back, last) != cell_fg(back, row + x) ||
+                    cell_bg(back, last) != cell_bg(back, row + x)))
+            {
+                cost_repaint += TB_REPAINT_ATTR_COST;
+            }
+            last = row + x;
+        }
+        cost_repaint += (size_t)end + (end < w);
+    }
+    if (cost_repaint >= cost_diff) {
+        return TB_OK;
+    }
+
+    uintattr_t attr_default = TB_DEFAULT;
+#ifdef TB_OPT_TRUECOLOR
+    if (global.output_mode == TB_OUTPUT_TRUECOLOR) {
+        attr_default = TB_TRUECOLOR_DEFAULT;
+    }
+#endif
+    if_err_return(rv, send_attr(attr_default, attr_default));
+    if_err_return(rv,
+        bytebuf_puts(&enc->out, global.caps[TB_CAP_CLEAR_SCREEN]));
+
+    // Clearing homes the cursor. Blank cells are now correct and all others
+    // differ from the cleared front cells.
+    enc->last_x = 0;
+    enc->last_y = 0;
+    uint32_t space = (uint32_t)' ';
+    for (i = 0; i < w * h; i++) {
+        if (cell_is_blank(back, i, 1)) {
+            if_err_return(rv, cell_copy(front, i, back, i));
+        } else {
+            if_err_return(rv,
+                cell_set(front, i, &space, 1, attr_default, attr_default));
+        }
+    }
+
+    enc->stats.repainted = 1;
+    if_err_return(rv, cellbuf_dirty_all(front));
+    return cellbuf_dirty_all(back);
+}
+
+static int present_held(void) {
+    if (global.max_fps <= 0 || present_due_us() <= 0) {
+        return 0;
+    }
+    // Too soon after the last frame. Hold this one back until the interval
+    // is over, when wait_event() or a later present sends it along with
+    // whatever changed in the meantime.
+    global.frames_merged++;
+    if (global.frame_pending) {
+        global.frames_dropped++;
+    }
+    global.frame_pending = 1;
+    return 1;
+}
+
+static int64_t present_due_us(void) {
+    // Time left until the next frame may be sent
+    if (global.max_fps <= 0) {
+        return 0;
+    }
+    return global.frame_time + 1000000 / global.max_fps - monotonic_us();
+}
+
+static int64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int send_attr(uintattr_t fg, uintattr_t bg) {
+    int rv;
+
+    if (fg == enc->last_fg && bg == enc->last_bg) {
+        return TB_OK;
+    }
+
+    // The sequence depends on the previous attributes only if it's a delta
+    struct sgr_cache_entry_t *slot = NULL;
+    size_t start = enc->out.len;
+    if (enc->has_last_sgr) {
+        uintattr_t from_fg = 0, from_bg = 0;
+        if (global.opt_caps & TB_OPTCAP_ECMA_SGR) {
+            from_fg = enc->last_fg;
+            from_bg = enc->last_bg;
+        }
+        slot = sgr_cache_slot(from_fg, from_bg, fg, bg);
+        if (slot->mode == global.output_mode && slot->from_fg == from_fg &&
+            slot->from_bg == from_bg && slot->fg == fg && slot->bg == bg)
+        {
+            enc->stats.sgr_cache_hits++;
+            if_err_return(rv,
+                bytebuf_nputs(&enc->out, slot->seq, slot->len));
+            enc->last_sgr = slot->sgr;
+            enc->last_fg = fg;
+            enc->last_bg = bg;
+            return TB_OK;
+        }
+        slot->mode = 0;
+        slot->from_fg = from_fg;
+        slot->from_bg = from_bg;
+    }
+    enc->stats.sgr_cache_misses++;
+
+    uintattr_t orig_fg = fg, orig_bg = bg;
+    uintattr_t cfg, cbg;
+    switch (global.output_mode) {
+        default:
+        case TB_OUTPUT_NORMAL:
+            cfg = fg & 0x0f;
+            cbg = bg & 0x0f;
+            break;
+
+        case TB_OUTPUT_256:
+            cfg = fg & 0xff;
+            cbg = bg & 0xff;
+            break;
+
+        case TB_OUTPUT_216:
+            cfg = fg & 0xff;
+            cbg = bg & 0xff;
+            if (cfg > 216)
+                cfg = 216;
+            if (cbg > 216)
+                cbg = 216;
+            cfg += 0x0f;
+            cbg += 0x0f;
+            break;
+
+        case TB_OUTPUT_GRAYSCALE:
+            cfg = fg & 0xff;
+            cbg = bg & 0xff;
+            if (cfg > 24)
+                cfg = 24;
+            if (cbg > 24)
+                cbg = 24;
+            cfg += 0xe7;
+            cbg += 0xe7;
+            break;
+
+#ifdef TB_OPT_TRUECOLOR
+        case TB_OUTPUT_TRUECOLOR:
+            cfg = fg & 0xffffff;
+            cbg = bg & 0xffffff;
+            break;
+#endif
+    }
+
+    uintattr_t attr_bold, attr_blink, attr_italic, attr_underline, attr_reverse,
+        attr_default;
+#ifdef TB_OPT_TRUECOLOR
+    if (global.output_mode == TB_OUTPUT_TRUECOLOR) {
+        attr_bold = TB_TRUECOLOR_BOLD;
+        attr_blink = TB_TRUECOLOR_BLINK;
+        attr_italic = TB_TRUECOLOR_ITALIC;
+        attr_underline = TB_TRUECOLOR_UNDERLINE;
+        attr_reverse = TB_TRUECOLOR_REVERSE;
+        attr_default = TB_TRUECOLOR_DEFAULT;
+    } else
+#endif
+    {
+        attr_bold = TB_BOLD;
+        attr_blink = TB_BLINK;
+        attr_italic = TB_ITALIC;
+        attr_underline = TB_UNDERLINE;
+        attr_reverse = TB_REVERSE;
+        attr_default = TB_DEFAULT;
+    }
+
+    /* For convenience (and some back compat), interpret 0 as default in some
+     * modes */
+    if (global.output_mode == TB_OUTPUT_NORMAL ||
+        global.output_mode == TB_OUTPUT_216 ||
+        global.output_mode == TB_OUTPUT_GRAYSCALE)
+    {
+        if ((fg & 0xff) == 0)
+            fg |= attr_default;
+        if ((bg & 0xff) == 0)
+            bg |= attr_default;
+    }
+
+    struct sgr_t sgr;
+    sgr.attrs = 0;
+    if ((fg & attr_bold) && *global.caps[TB_CAP_BOLD])
+        sgr.attrs |= TB_SGR_BOLD;
+    if ((fg & attr_blink) && *global.caps[TB_CAP_BLINK])
+        sgr.attrs |= TB_SGR_BLINK;
+    if ((fg & attr_underline) && *global.caps[TB_CAP_UNDERLINE])
+        sgr.attrs |= TB_SGR_UNDERLINE;
+    if ((fg & attr_italic) && *global.caps[TB_CAP_ITALIC])
+        sgr.attrs |= TB_SGR_ITALIC;
+    if (((fg & attr_reverse) || (bg & attr_reverse)) &&
+        *global.caps[TB_CAP_REVERSE])
+        sgr.attrs |= TB_SGR_REVERSE;
+    if (fg & attr_default)
+        sgr.attrs |= TB_SGR_FG_DEFAULT;
+    if (bg & attr_default)
+        sgr.attrs |= TB_SGR_BG_DEFAULT;
+    sgr.cfg = (fg & attr_default) ? 0 : cfg;
+    sgr.cbg = (bg & attr_default) ? 0 : cbg;
+
+    if (enc->has_last_sgr && (global.opt_caps & TB_OPTCAP_ECMA_SGR)) {
+        if_err_return(rv, send_sgr_delta(&enc->last_sgr, &sgr));
+    } else {
+        if_err_return(rv,
+            bytebuf_puts(&enc->out, global.caps[TB_CAP_SGR0]));
+
+        if (sgr.attrs & TB_SGR_BOLD)
+            if_err_return(rv,
+                bytebuf_puts(&enc->out, global.caps[TB_CAP_BOLD]));
+
+        if (sgr.attrs & TB_SGR_BLINK)
+            if_err_return(rv,
+                bytebuf_puts(&enc->out, global.caps[TB_CAP_BLINK]));
+
+        if (sgr.attrs & TB_SGR_UNDERLINE)
+            if_err_return(rv,
+                bytebuf_puts(&enc->out, global.caps[TB_CAP_UNDERLINE]));
+
+        if (sgr.attrs & TB_SGR_ITALIC)
+            if_err_return(rv,
+                bytebuf_puts(&enc->out, global.caps[TB_CAP_ITALIC]));
+
+        if (sgr.attrs & TB_SGR_REVERSE)
+            if_err_return(rv,
+                bytebuf_puts(&enc->out, global.caps[TB_CAP_REVERSE]));
+
+        if_err_return(rv,
+            send_sgr(cfg, cbg, fg & attr_default, bg & attr_default));
+    }
+
+    enc->last_sgr = sgr;
+    enc->has_last_sgr = 1;
+    enc->last_fg = orig_fg;
+    enc->last_bg = orig_bg;
+
+    size_t len = enc->out.len - start;
+    if (slot && len <= sizeof(slot->seq)) {
+        slot->mode = global.output_mode;
+        slot->fg = orig_fg;
+        slot->bg = orig_bg;
+        slot->sgr = sgr;
+        slot->len = (uint8_t)len;
+        memcpy(slot->seq, &enc->out.buf[start], len);
+    }
+
+    return TB_OK;
+}
+
+static struct sgr_cache_entry_t *sgr_cache_slot(uintattr_t from_fg,
+    uintattr_t from_bg, uintattr_t fg, uintattr_t bg) {
+    // Direct-mapped, so a colliding change simply replaces the old one. The
+    // double shift folds in the high half of 64-bit attributes.
+    uint32_t h = 2166136261u;
+    h = (h ^ (uint32_t)(from_fg ^ (from_fg >> 16 >> 16))) * 16777619u;
+    h = (h ^ (uint32_t)(from_bg ^ (from_bg >> 16 >> 16))) * 16777619u;
+    h = (h ^ (uint32_t)(fg ^ (fg >> 16 >> 16))) * 16777619u;
+    h = (h ^ (uint32_t)(bg ^ (bg >> 16 >> 16))) * 16777619u;
+    h ^= h >> 16;
+    return &enc->sgr_cache[h & (TB_SGR_CACHE_SIZE - 1)];
+}
+
+static int send_sgr(uintattr_t cfg, uintattr_t cbg, uintattr_t fg_is_default,
+    uintattr_t bg_is_default) {
+    char buf[TB_SGR_PARAMS_LEN + 3];
+    int len = 2;
+
+    if (fg_is_default && bg_is_default) {
+        return TB_OK;
+    }
+
+    memcpy(buf, "\x1b[", 2);
+    if (!fg_is_default) {
+        len += sgr_color_param(&buf[len], cfg, 0);
+        if (!bg_is_default) {
+            buf[len++] = ';';
+        }
+    }
+    if (!bg_is_default) {
+        len += sgr_color_param(&buf[len], cbg, 1);
+    }
+    buf[len++] = 'm';
+    return bytebuf_nputs(&enc->out, buf, (size_t)len);
+}
+
+static int send_sgr_delta(struct sgr_t *from, struct sgr_t *to) {
+    // Send the shorter of the changes from one SGR state to another and a
+    // reset followed by the new state. Both are single ECMA-48 sequences.
+    static const struct {
+        int attr;
+        const char *on;
+        const char *off;
+    } attrs[] = {
+        {TB_SGR_BOLD,      "1", "22"},
+        {TB_SGR_BLINK,     "5", "25"},
+        {TB_SGR_UNDERLINE, "4", "24"},
+        {TB_SGR_ITALIC,    "3", "23"},
+        {TB_SGR_REVERSE,   "7", "27"},
+    };
+    char delta[TB_SGR_PARAMS_LEN], reset[TB_SGR_PARAMS_LEN], cbuf[32];
+    int ndelta = 0, nreset = 0, ncbuf;
+    size_t i;
+
+    for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+        int on = to->attrs & attrs[i].attr;
+        if (on) {
+            sgr_append(reset, &nreset, attrs[i].on, 1);
+        }
+        if (on != (from->attrs & attrs[i].attr)) {
+            sgr_append(delta, &ndelta, on ? attrs[i].on : attrs[i].off,
+                (int)strlen(on ? attrs[i].on : attrs[i].off));
+        }
+    }
+
+    if (!(to->attrs & TB_SGR_FG_DEFAULT)) {
+        ncbuf = sgr_color_param(cbuf, to->cfg, 0);
+        sgr_append(reset, &nreset, cbuf, ncbuf);
+        if ((from->attrs & TB_SGR_FG_DEFAULT) || from->cfg != to->cfg) {
+            sgr_append(delta, &ndelta, cbuf, ncbuf);
+        }
+    } else if (!(from->attrs & TB_SGR_FG_DEFAULT)) {
+        sgr_append(delta, &ndelta, "39", 2);
+    }
+
+    if (!(to->attrs & TB_SGR_BG_DEFAULT)) {
+        ncbuf = sgr_color_param(cbuf, to->cbg, 1);
+        sgr_append(reset, &nreset, cbuf, ncbuf);
+        if ((from->attrs & TB_SGR_BG_DEFAULT) || from->cbg != to->cbg) {
+            sgr_append(delta, &ndelta, cbuf, ncbuf);
+        }
+    } else if (!(from->attrs & TB_SGR_BG_DEFAULT)) {
+        sgr_append(delta, &ndelta, "49", 2);
+    }
+
+    if (ndelta == 0) {
+        // Different attributes that look the same
+        return TB_OK;
+    }
+
+    int rv;
+    send_literal(rv, "\x1b[");
+    if (nreset + (nreset > 0 ? 2 : 0) < ndelta) {
+        if (nreset > 0) {
+            send_literal(rv, "0;");
+            if_err_return(rv,
+                bytebuf_nputs(&enc->out, reset, (size_t)nreset));
+        }
+    } else {
+        if_err_return(rv, bytebuf_nputs(&enc->out, delta, (size_t)ndelta));
+    }
+    send_literal(rv, "m");
+    return TB_OK;
+}
+
+static int sgr_color_param(char *buf, uintattr_t c, int is_bg) {
+    // SGR parameters that select color c for the fg or bg in the current
+    // output mode. Writes at most 16 bytes, not NUL-terminated.
+    int len = 0;
+    switch (global.output_mode) {
+        default:
+        case TB_OUTPUT_NORMAL:
+            buf[len++] = is_bg ? '4' : '3';
+            len += convert_num(c - 1, &buf[len]);
+            break;
+
+        case TB_OUTPUT_256:
+        case TB_OUTPUT_216:
+        case TB_OUTPUT_GRAYSCALE:
+            memcpy(buf, is_bg ? "48;5;" : "38;5;", 5);
+            len = 5;
+            len += convert_num(c, &buf[len]);
+            break;
+
+#ifdef TB_OPT_TRUECOLOR
+        case TB_OUTPUT_TRUECOLOR:
+            memcpy(buf, is_bg ? "48;2;" : "38;2;", 5);
+            len = 5;
+            len += convert_num((c >> 16) & 0xff, &buf[len]);
+            buf[len++] = ';';
+            len += convert_num((c >> 8) & 0xff, &buf[len]);
+            buf[len++] = ';';
+            len += convert_num(c & 0xff, &buf[len]);
+            break;
+#endif
+    }
+    return len;
+}
+
+static void sgr_append(char *buf, int *len, const char *param, int nparam) {
+    if (*len > 0) {
+        buf[(*len)++] = ';';
+    }
+    memcpy(&buf[*len], param, (size_t)nparam);
+    *len += nparam;
+}
+
+static void term_state_save(struct term_state_t *s) {
+    s->last_x = enc->last_x;
+    s->last_y = enc->last_y;
+    s->last_fg = enc->last_fg;
+    s->last_bg = enc->last_bg;
+    s->last_sgr = enc->last_sgr;
+    s->has_last_sgr = enc->has_last_sgr;
+}
+
+static void term_state_restore(struct term_state_t *s) {
+    enc->last_x = s->last_x;
+    enc->last_y = s->last_y;
+    enc->last_fg = s->last_fg;
+    enc->last_bg = s->last_bg;
+    enc->last_sgr = s->last_sgr;
+    enc->has_last_sgr = s->has_last_sgr;
+}
+
+static int term_state_eq(struct term_state_t *a, struct term_state_t *b) {
+    if (a->last_x != b->last_x || a->last_y != b->last_y ||
+        a->last_fg != b->last_fg || a->last_bg != b->last_bg ||
+        a->has_last_sgr != b->has_last_sgr)
+    {
+        return 0;
+    }
+    // The SGR state only matters once something was sent
+    return !a->has_last_sgr || (a->last_sgr.attrs == b->last_sgr.attrs &&
+                                   a->last_sgr.cfg == b->last_sgr.cfg &&
+                                   a->last_sgr.cbg == b->last_sgr.cbg);
+}
+
+static struct row_cache_entry_t *row_cache_find(uint32_t hash, int y,
+    struct term_state_t *from) {
+    // The hash only narrows down candidates, the cells are compared in full
+    struct row_cache_entry_t *e;
+    int w = global.front.width;
+    size_t nkeys = (size_t)w * TB_CELL_KEY_LEN;
+    for (e = global.row_cache.buckets[hash & (TB_ROW_CACHE_BUCKETS - 1)]; e;
+         e = e->next)
+    {
+        if (e->hash != hash || e->y != y || e->width != w ||
+            !term_state_eq(&e->from, from))
+        {
+            continue;
+        }
+        if (cellbuf_row_key_eq(global.draw, y, e->data) &&
+            cellbuf_row_key_eq(&global.front, y, &e->data[nkeys]))
+        {
+            row_cache_unlink(e);
+            row_cache_link(e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void row_cache_add(struct row_cache_entry_t *e) {
+    struct row_cache_entry_t **bucket =
+        &global.row_cache.buckets[e->hash & (TB_ROW_CACHE_BUCKETS - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    row_cache_link(e);
+    global.row_cache.size += e->size;
+    row_cache_trim(global.row_cache.max_size);
+}
+
+static void row_cache_link(struct row_cache_entry_t *e) {
+    // As the most recently used
+    e->newer = NULL;
+    e->older = global.row_cache.newest;
+    if (e->older) {
+        e->older->newer = e;
+    } else {
+        global.row_cache.oldest = e;
+    }
+    global.row_cache.newest = e;
+}
+
+static void row_cache_unlink(struct row_cache_entry_t *e) {
+    if (e->newer) {
+        e->newer->older = e->older;
+    } else {
+        global.row_cache.newest = e->older;
+    }
+    if (e->older) {
+        e->older->newer = e->newer;
+    } else {
+        global.row_cache.oldest = e->newer;
+    }
+}
+
+static void row_cache_trim(size_t max_size) {
+    // Drop the least recently used rows until the rest fit
+    while (global.row_cache.size > max_size) {
+        struct row_cache_entry_t *e = global.row_cache.oldest;
+        struct row_cache_entry_t **link =
+            &global.row_cache.buckets[e->hash & (TB_ROW_CACHE_BUCKETS - 1)];
+        while (*link != e) {
+            link = &(*link)->next;
+        }
+        *link = e->next;
+        row_cache_unlink(e);
+        global.row_cache.size -= e->size;
+        tb_free(e);
+    }
+}
+
+static int send_cursor_if(int x, int y) {
+    int rv;
+    if (x < 0 || y < 0) {
+        return TB_OK;
+    }
+    size_t start = enc->out.len;
+    if (enc->last_x >= 0 && enc->last_y >= 0 &&
+        enc->last_x < global.front.width && x < global.front.width &&
+        y < global.front.height)
+    {
+        if_err_return(rv, send_motion(x, y));
+    } else {
+        if_err_return(rv, send_cup(x, y));
+    }
+    enc->last_x = x;
+    enc->last_y = y;
+    enc->stats.cursor_moves++;
+    enc->stats.cursor_bytes += enc->out.len - start;
+    return TB_OK;
+}
+
+/* Horizontal motions (motion_hcost) */
+#define TB_MOTION_NONE    0
+#define TB_MOTION_CUF     1
+#define TB_MOTION_CUB     2
+#define TB_MOTION_BS      3
+#define TB_MOTION_REPRINT 4
+#define TB_MOTION_CHA     5
+
+static int send_motion(int x, int y) {
+    // Pick the cheapest way to get from the known cursor position to (x, y),
+    // similar to ncurses' mvcur(). Candidates are an absolute CUP, or a
+    // vertical move (line feeds, CUD/CUU, VPA) combined with a horizontal one
+    // (CUF/CUB, backspaces, CHA, re-printing the cells in between), possibly
+    // after a carriage return.
+    int rv, i;
+    int cx = enc->last_x, cy = enc->last_y;
+    int dy = y - cy;
+    int caps = global.opt_caps;
+
+    char nbuf[32];
+    int best = x == 0 ? motion_num_cost(y + 1)
+                      : 4 + convert_num(y + 1, nbuf) + convert_num(x + 1, nbuf);
+    int best_v = -1, best_cr = 0, best_h = TB_MOTION_NONE;
+
+    // Vertical part: 0 none, 1 line feeds, 2 CUD/CUU, 3 VPA
+    int vkind = -1, vcost = 0;
+    if (dy == 0) {
+        vkind = 0;
+    } else if (dy > 0) {
+        vkind = 1;
+        vcost = dy;
+        if ((caps & TB_OPTCAP_CUD) && motion_num_cost(dy) < vcost) {
+            vkind = 2;
+            vcost = motion_num_cost(dy);
+        }
+    } else if (caps & TB_OPTCAP_CUU) {
+        vkind = 2;
+        vcost = motion_num_cost(-dy);
+    }
+    if (dy != 0 && (caps & TB_OPTCAP_VPA) &&
+        (vkind < 0 || motion_num_cost(y + 1) < vcost))
+    {
+        vkind = 3;
+        vcost = motion_num_cost(y + 1);
+    }
+
+    if (vkind >= 0 && vcost < best) {
+        int kind, cost;
+
+        // From the current column
+        cost = vcost + motion_hcost(cx, x, y, best - vcost, &kind);
+        if (cost < best) {
+            best = cost;
+            best_v = vkind;
+            best_h = kind;
+        }
+
+        // From the first column after a carriage return
+        cost = vcost + 1 + motion_hcost(0, x, y, best - vcost - 1, &kind);
+        if (cost < best) {
+            best = cost;
+            best_v = vkind;
+            best_cr = 1;
+            best_h = kind;
+        }
+
+        // To an absolute column
+        cost = vcost + motion_num_cost(x + 1);
+        if ((caps & TB_OPTCAP_HPA) && cx != x && cost < best) {
+            best = cost;
+            best_v = vkind;
+            best_cr = 0;
+            best_h = TB_MOTION_CHA;
+        }
+    }
+
+    if (best_v < 0) {
+        // Nothing beats an absolute move
+        return send_cup(x, y);
+    }
+
+    switch (best_v) {
+        case 1:
+            for (i = 0; i < dy; i++) {
+                send_literal(rv, "\n");
+            }
+            break;
+        case 2:
+            if_err_return(rv, send_csi_num(dy > 0 ? dy : -dy, dy > 0 ? 'B' : 'A'));
+            break;
+        case 3:
+            if_err_return(rv, send_csi_num(y + 1, 'd'));
+            break;
+    }
+
+    int c = cx;
+    if (best_cr) {
+        send_literal(rv, "\r");
+        c = 0;
+    }
+
+    switch (best_h) {
+        case TB_MOTION_CUF:
+            return send_csi_num(x - c, 'C');
+        case TB_MOTION_CUB:
+            return send_csi_num(c - x, 'D');
+        case TB_MOTION_BS:
+            for (i = c; i > x; i--) {
+                send_literal(rv, "\b");
+            }
+            break;
+        case TB_MOTION_REPRINT: {
+            // Cells in between are known to be printable ASCII in the current
+            // attributes, see motion_hcost()
+            int row = y * global.front.width;
+            for (i = c; i < x; i++) {
+                uint32_t cp = cell_ch(motion_cells(i, y), row + i);
+                char ch = cp ? (char)cp : ' ';
+                if_err_return(rv, bytebuf_nputs(&enc->out, &ch, 1));
+            }
+            break;
+        }
+        case TB_MOTION_CHA:
+            return send_csi_num(x + 1, 'G');
+    }
+    return TB_OK;
+}
+
+static int send_cup(int x, int y) {
+    int rv;
+    char nbuf[32];
+    if (x == 0) {
+        return send_csi_num(y + 1, 'H');
+    }
+    send_literal(rv, "\x1b[");
+    send_num(rv, nbuf, y + 1);
+    send_literal(rv, ";");
+    send_num(rv, nbuf, x + 1);
+    send_literal(rv, "H");
+    return TB_OK;
+}
+
+static int send_csi_num(int n, char final) {
+    // CSI sequence with a single numeric parameter, which is omitted when it's
+    // the default of 1
+    int rv;
+    char nbuf[32];
+    send_literal(rv, "\x1b[");
+    if (n != 1) {
+        send_num(rv, nbuf, n);
+    }
+    return bytebuf_nputs(&enc->out, &final, 1);
+}
+
+static int motion_num_cost(int n) {
+    // Length of the sequence sent by send_csi_num()
+    char nbuf[32];
+    return 3 + (n != 1 ? convert_num(n, nbuf) : 0);
+}
+
+static int motion_hcost(int c, int x, int y, int limit, int *kind) {
+    // Cheapest way from column c to column x on row y, or limit if there's
+    // nothing cheaper than that
+    int i, cost = limit;
+    *kind = TB_MOTION_NONE;
+    if (c == x) {
+        return 0;
+    }
+
+    if (x > c) {
+        if ((global.opt_caps & TB_OPTCAP_CUF) && motion_num_cost(x - c) < cost) {
+            cost = motion_num_cost(x - c);
+            *kind = TB_MOTION_CUF;
+        }
+
+        // Re-printing works for plain ASCII cells in the current attributes
+        if (x - c < cost) {
+            int row = y * global.front.width;
+            for (i = c; i < x; i++) {
+                struct cellbuf_t *cells = motion_cells(i, y);
+                uint32_t ch = cell_ch(cells, row + i);
+                if ((ch != 0 && (ch < 0x20 || ch > 0x7e)) ||
+                    cell_fg(cells, row + i) != enc->last_fg ||
+                    cell_bg(cells, row + i) != enc->last_bg)
+                {
+                    break;
+                }
+            }
+            if (i == x) {
+                cost = x - c;
+                *kind = TB_MOTION_REPRINT;
+            }
+        }
+    } else {
+        if (c - x < cost) {
+            cost = c - x;
+            *kind = TB_MOTION_BS;
+        }
+        if ((global.opt_caps & TB_OPTCAP_CUB) && motion_num_cost(c - x) < cost) {
+            cost = motion_num_cost(c - x);
+            *kind = TB_MOTION_CUB;
+        }
+    }
+
+    return cost;
+}
+
+static struct cellbuf_t *motion_cells(int x, int y) {
+    // The cells the terminal shows, for re-printing them. That's the front
+    // buffer, except for cells send_run() erased ahead of the cursor: while
+    // present_bands() holds off updating the front rows, those are only
+    // blank in the back buffer.
+    if (y == enc->erased_y && x >= enc->erased_x &&
+        x < enc->erased_x + enc->erased_n)
+    {
+        return global.draw;
+    }
+    return &global.front;
+}
+
+static int send_scroll(int top, int bot, int n) {
+    int rv, i;
+    char nbuf[32];
+
+    send_literal(rv, "\x1b[");
+    send_num(rv, nbuf, top + 1);
+    send_literal(rv, ";");
+    send_num(rv, nbuf, bot + 1);
+    send_literal(rv, "r");
+
+    // Setting the scroll region homes the cursor
+    enc->last_x = -1;
+    enc->last_y = -1;
+
+    if (n > 0 && (global.opt_caps & TB_OPTCAP_INDN)) {
+        send_literal(rv, "\x1b[");
+        send_num(rv, nbuf, n);
+        send_literal(rv, "S");
+    } else if (n < 0 && (global.opt_caps & TB_OPTCAP_RIN)) {
+        send_literal(rv, "\x1b[");
+        send_num(rv, nbuf, -n);
+        send_literal(rv, "T");
+    } else if (n > 0) {
+        // A line feed at the bottom margin scrolls the region up
+        if_err_return(rv, send_cursor_if(0, bot));
+        for (i = 0; i < n; i++) {
+            send_literal(rv, "\n");
+        }
+    } else {
+        // A reverse index at the top margin scrolls the region down
+        if_err_return(rv, send_cursor_if(0, top));
+        for (i = 0; i < -n; i++) {
+            if_err_return(rv,
+                bytebuf_puts(&enc->out, TB_HARDCAP_REVERSE_INDEX));
+        }
+    }
+
+    if_err_return(rv,
+        bytebuf_puts(&enc->out, TB_HARDCAP_RESET_SCROLL_REGION));
+
+    enc->last_x = -1;
+    enc->last_y = -1;
+
+    return TB_OK;
+}
+
+static int send_run(int x, int y, int x1, int *nrun) {
+    // Send a run of identical single-width cells starting at the changed cell
+    // at x with REP, ECH or EL when that is shorter than printing each cell.
+    // Sets nrun to the number of cells sent, or 0 if the caller should send
+    // the cell as usual.
+    int rv, i;
+    char abuf[8];
+    struct cellbuf_t *back = global.draw, *front = &global.front;
+    int w = back->width, row = y * w, cell = row + x;
+    uint8_t *wrow = &back->widths[row];
+
+    *nrun = 0;
+    if (cell_ch(back, cell) == TB_SHADOW_CH) {
+        return TB_OK;
+    }
+#ifdef TB_OPT_EGC
+    if (cell_has_cluster(back, cell)) {
+        return TB_OK;
+    }
+#endif
+
+    uint32_t ch = cell_ch(back, cell) ? cell_ch(back, cell) : (uint32_t)' ';
+    int caps = global.opt_caps;
+    int repeatable = (caps & TB_OPTCAP_REP) && ch >= 0x20 && ch < 0x7f;
+    int erasable = (caps & (TB_OPTCAP_ECH | TB_OPTCAP_EL)) &&
+                   cell_is_erasable(back, cell);
+    if (!repeatable && !erasable) {
+        return TB_OK;
+    }
+
+    // Cells up to n are identical and changed, and look the same up to n_eol
+    int n, n_eol;
+    for (n = 1; x + n < w; n++) {
+        if (wrow[x + n] == 0) {
+            wrow[x + n] = cell_width(back, cell + n);
+        }
+        if (wrow[x + n] != 1 || cell_cmp(back, cell + n, back, cell) != 0) {
+            break;
+        }
+        if (x + n > x1 || cell_cmp(back, cell + n, front, cell + n) == 0) {
+            break;
+        }
+    }
+    for (n_eol = n; x + n_eol < w; n_eol++) {
+        if (wrow[x + n_eol] == 0) {
+            wrow[x + n_eol] = cell_width(back, cell + n_eol);
+        }
+        int other = cell + n_eol;
+        if (wrow[x + n_eol] != 1) {
+            break;
+        }
+        if (cell_cmp(back, other, back, cell) != 0 &&
+            !(erasable && cell_is_erasable(back, other) &&
+                (cell_bg(back, other) == cell_bg(back, cell) ||
+                    !(caps & TB_OPTCAP_BCE))))
+        {
+            break;
+        }
+    }
+    if (x + n_eol < w) {
+        n_eol = 0;
+    }
+    if (n < 3 && n_eol == 0) {
+        return TB_OK;
+    }
+
+    int chlen = tb_utf8_unicode_to_char(abuf, ch);
+
+    // Cost of each encoding, with ECH also paying for moving past the run
+    int cost_plain = n * chlen;
+    int cost_rep = repeatable && n > 1
+                       ? chlen + motion_num_cost(n - 1)
+                       : cost_plain;
+    int cost_ech = erasable && (caps & TB_OPTCAP_ECH)
+                       ? motion_num_cost(n) + motion_num_cost(n)
+                       : cost_plain;
+    int cost_el = erasable && n_eol > 0 && (caps & TB_OPTCAP_EL)
+                      ? 3
+                      : n_eol * chlen;
+
+    char kind;
+    if (n_eol > 0 && cost_el < n_eol * chlen && cost_el <= cost_rep &&
+        cost_el <= cost_ech)
+    {
+        kind = 'K';
+        n = n_eol;
+    } else if (cost_rep < cost_plain && cost_rep <= cost_ech) {
+        kind = 'b';
+    } else if (cost_ech < cost_plain) {
+        kind = 'X';
+    } else {
+        return TB_OK;
+    }
+
+    if_err_return(rv, send_attr(cell_fg(back, cell), cell_bg(back, cell)));
+    if (kind == 'b') {
+        if_err_return(rv, send_char(x, y, ch, 1));
+        if_err_return(rv, send_csi_num(n - 1, 'b'));
+        if (x + n < global.front.width) {
+            enc->last_x = x + n;
+            enc->last_y = y;
+        } else {
+            // Pending wrap
+            enc->last_x = -1;
+            enc->last_y = -1;
+        }
+    } else {
+        // Erasing leaves the cursor where it is
+        if (enc->last_x != x || enc->last_y != y) {
+            if_err_return(rv, send_cursor_if(x, y));
+        }
+        enc->erased_x = x;
+        enc->erased_y = y;
+        enc->erased_n = n;
+        if (kind == 'K') {
+            send_literal(rv, "\x1b[K");
+        } else {
+            if_err_return(rv, send_csi_num(n, 'X'));
+        }
+    }
+
+    if (!global.present_banded) {
+        for (i = cell; i < cell + n; i++) {
+            if_err_return(rv, cell_copy(front, i, back, i));
+        }
+    }
+    enc->stats.cells += n;
+    *nrun = n;
+    return TB_OK;
+}
+
+static int send_char(int x, int y, uint32_t ch, int w) {
+    return send_cluster(x, y, &ch, 1, w);
+}
+
+static int send_cluster(int x, int y, uint32_t *ch, size_t nch, int w) {
+    int rv;
+    char abuf[8];
+
+    if (x == 0 && enc->last_x == global.front.width &&
+        y == enc->last_y + 1)
+    {
+        // Printing lands here through the pending autowrap
+        enc->last_y = y;
+    } else if (enc->last_x != x || enc->last_y != y) {
+        if_err_return(rv, send_cursor_if(x, y));
+    }
+
+    // Past a wide cell the terminal may disagree on the width. In the last
+    // column a wrap is pending, which is only certain to take the next
+    // character to the next row, so that is all that's recorded.
+    if (w == 1 && x + 1 < global.front.width) {
+        enc->last_x = x + 1;
+    } else if (w == 1 && (global.opt_caps & TB_OPTCAP_AM) &&
+               y + 1 < global.front.height)
+    {
+        enc->last_x = global.front.width;
+        enc->last_y = y;
+    } else {
+        enc->last_x = -1;
+        enc->last_y = -1;
+    }
+
+    enc->stats.cells++;
+    int i;
+    for (i = 0; i < (int)nch; i++) {
+        uint32_t ach = *(ch + i);
+        int aw = tb_utf8_unicode_to_char(abuf, ach);
+        if (!ach) {
+            abuf[0] = ' ';
+        }
+        if_err_return(rv, bytebuf_nputs(&enc->out, abuf, (size_t)aw));
+    }
+
+    return TB_OK;
+}
+
+static int convert_num(uint32_t num, char *buf) {
+    int i, l = 0;
+    char ch;
+    do {
+        /* '0' = 48; 48 + num%10 < 58 < MAX_8bitCHAR */
+        buf[l++] = (char)('0' + (num % 10));
+        num /= 10;
+    } while (num);
+    for (i = 0; i < l / 2; i++) {
+        ch = buf[i];
+        buf[i] = buf[l - 1 - i];
+        buf[l - 1 - i] = ch;
+    }
+    return l;
+}
+
+static int cell_width(struct cellbuf_t *c, int i) {
+    int w;
+#ifdef TB_OPT_EGC
+    struct cluster_t *cluster = cluster_find(cell_ch(c, i));
+    if (cluster)
+        w = wcswidth((wchar_t *)cluster->ch, cluster->nch);
+    else
+#endif
+        /* wcwidth() simply returns -1 on overflow of wchar_t */
+        w = wcwidth((wchar_t)cell_ch(c, i));
+    return w < 1 ? 1 : w > UINT8_MAX ? UINT8_MAX : w;
+}
+
+static int cell_is_erasable(struct cellbuf_t *c, int i) {
+    // Whether erasing (ECH/EL) in the cell's attributes leaves the same thing
+    // on screen as printing it. Erased cells get the current background only
+    // on back_color_erase terminals and never get underline or reverse.
+    return cell_is_blank(c, i, !(global.opt_caps & TB_OPTCAP_BCE));
+}
+
+static int cell_is_blank(struct cellbuf_t *c, int i, int default_bg) {
+    // Whether the cell shows nothing but its background, which must be the
+    // default one if default_bg is set
+    uintattr_t attr_underline = TB_UNDERLINE, attr_reverse = TB_REVERSE,
+               attr_default = TB_DEFAULT, color_mask = 0xff;
+#ifdef TB_OPT_TRUECOLOR
+    if (global.output_mode == TB_OUTPUT_TRUECOLOR) {
+        attr_underline = TB_TRUECOLOR_UNDERLINE;
+        attr_reverse = TB_TRUECOLOR_REVERSE;
+        attr_default = TB_TRUECOLOR_DEFAULT;
+        color_mask = 0;
+    }
+#endif
+    uint32_t ch = cell_ch(c, i);
+    uintattr_t bg = cell_bg(c, i);
+    if ((ch != ' ' && ch != 0) ||
+        ((cell_fg(c, i) | bg) & (attr_underline | attr_reverse)))
+    {
+        return 0;
+    }
+    if (!default_bg) {
+        return 1;
+    }
+    // See send_attr() for when 0 is interpreted as the default color
+    return (bg & attr_default) ||
+           (color_mask && (bg & color_mask) == 0 &&
+               global.output_mode != TB_OUTPUT_256);
+}
+
+static int cell_cmp(struct cellbuf_t *a, int ai, struct cellbuf_t *b, int bi) {
+    // Equal clusters have the same id
+    return cell_ch(a, ai) != cell_ch(b, bi) || cell_fg(a, ai) != cell_fg(b, bi) ||
+           cell_bg(a, ai) != cell_bg(b, bi);
+}
+
+static int cell_run_cmp(struct cellbuf_t *a, int ai, struct cellbuf_t *b,
+    int bi, int n) {
+    // Number of cells from ai and bi that are equal, up to n. Cells are plain
+    // data without padding, a grapheme cluster being held by id, so they are
+    // compared as bytes.
+#ifdef TB_OPT_SOA
+    // Each array only up to the first difference found in the previous ones
+    n = (int)(global.mem_diff(&a->ch[ai], &b->ch[bi], n * sizeof(*a->ch)) /
+              sizeof(*a->ch));
+    n = (int)(global.mem_diff(&a->fg[ai], &b->fg[bi], n * sizeof(*a->fg)) /
+              sizeof(*a->fg));
+    n = (int)(global.mem_diff(&a->bg[ai], &b->bg[bi], n * sizeof(*a->bg)) /
+              sizeof(*a->bg));
+    return n;
+#else
+    return (int)(global.mem_diff(&a->cells[ai], &b->cells[bi],
+                     n * sizeof(struct cell_t)) /
+                 sizeof(struct cell_t));
+#endif
+}
+
+/* The mem_diff_* kernels return the offset of the first byte that differs
+ * between a[0..n) and b[0..n), or n if they are equal.
+ */
+static size_t mem_diff_scalar(const void *a, const void *b, size_t n) {
+    const char *pa = (const char *)a, *pb = (const char *)b;
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        uint64_t wa, wb;
+        memcpy(&wa, pa + i, 8);
+        memcpy(&wb, pb + i, 8);
+        if (wa != wb) {
+            break;
+        }
+    }
+    for (; i < n && pa[i] == pb[i]; i++)
+        ;
+    return i;
+}
+
+#ifdef TB_SIMD_X86
+__attribute__((target("sse2"))) static size_t mem_diff_sse2(const void *a,
+    const void *b, size_t n) {
+    const char *pa = (const char *)a, *pb = (const char *)b;
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(pa + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(pb + i));
+        int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (eq != 0xffff) {
+            return i + __builtin_ctz(~eq);
+        }
+    }
+    for (; i < n && pa[i] == pb[i]; i++)
+        ;
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t mem_diff_avx2(const void *a,
+    const void *b, size_t n) {
+    const char *pa = (const char *)a, *pb = (const char *)b;
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(pa + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(pb + i));
+        unsigned eq = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (eq != 0xffffffff) {
+            return i + __builtin_ctz(~eq);
+        }
+    }
+    for (; i < n && pa[i] == pb[i]; i++)
+        ;
+    return i;
+}
+#endif
+
+static int cell_copy(struct cellbuf_t *dst, int di, struct cellbuf_t *src,
+    int si) {
+#ifdef TB_OPT_EGC
+    // A cluster is shared by id, only the cells holding it are counted
+    if (cell_ch(dst, di) != cell_ch(src, si)) {
+        cluster_hold(cell_ch(src, si));
+        cluster_drop(cell_ch(dst, di));
+    }
+#endif
+    cell_ch(dst, di) = cell_ch(src, si);
+    cell_fg(dst, di) = cell_fg(src, si);
+    cell_bg(dst, di) = cell_bg(src, si);
+    return TB_OK;
+}
+
+static int cell_set(struct cellbuf_t *c, int i, uint32_t *ch, size_t nch,
+    uintattr_t fg, uintattr_t bg) {
+    uint32_t id = ch ? *ch : 0;
+#ifdef TB_OPT_EGC
+    if (nch > 1) {
+        // Take the new cluster before dropping the old one, which ch may be
+        int rv;
+        if_err_return(rv, cluster_get(ch, nch, &id));
+    } else if ((id & TB_CLUSTER_BIT) && id != TB_SHADOW_CH) {
+        // Not a code point, and would be taken for a cluster id
+        id = 0xfffd;
+    }
+    cluster_drop(cell_ch(c, i));
+#else
+    (void)nch;
+#endif
+    cell_ch(c, i) = id;
+    cell_fg(c, i) = fg;
+    cell_bg(c, i) = bg;
+    return TB_OK;
+}
+
+static int cell_free(struct cellbuf_t *c, int i) {
+#ifdef TB_OPT_EGC
+    cluster_drop(cell_ch(c, i));
+#endif
+    cell_ch(c, i) = 0;
+    cell_fg(c, i) = 0;
+    cell_bg(c, i) = 0;
+    return TB_OK;
+}
+
+#ifdef TB_OPT_EGC
+static int cell_has_cluster(struct cellbuf_t *c, int i) {
+    return (cell_ch(c, i) & TB_CLUSTER_BIT) && cell_ch(c, i) != TB_SHADOW_CH;
+}
+
+static int cluster_get(uint32_t *ch, size_t nch, uint32_t *out) {
+    // Clusters are kept in a table, one per distinct sequence of code points,
+    // and counted by the cells holding them. A cell holds a cluster by id, so
+    // cells compare and copy as plain data, and setting a cell to a cluster
+    // already in the table doesn't allocate.
+    struct cluster_table_t *t = &global.clusters;
+    size_t i;
+    uint32_t hash = 2166136261u;
+    for (i = 0; i < nch; i++) {
+        hash = (hash ^ ch[i]) * 16777619u;
+    }
+
+    cluster_lock();
+    struct cluster_t **bucket = &t->buckets[hash & (TB_CLUSTER_BUCKETS - 1)];
+    struct cluster_t *c;
+    for (c = *bucket; c; c = c->next) {
+        if (c->hash == hash && c->nch == nch &&
+            memcmp(c->ch, ch, nch * sizeof(*ch)) == 0)
+        {
+            break;
+        }
+    }
+    if (!c) {
+        if (t->nunused > TB_CLUSTER_UNUSED_MAX) {
+            cluster_sweep(0);
+        }
+        if (t->nfree == 0 && t->nids == t->cids) {
+            // Ids must stay below TB_SHADOW_CH
+            size_t cap = t->cids ? t->cids * 2 : 64;
+            struct cluster_t **ids;
+            uint32_t *free_ids;
+            if (t->cids >= TB_CLUSTER_BIT - 1 ||
+                !(ids = tb_realloc(t->ids, cap * sizeof(*ids))))
+            {
+                cluster_unlock();
+                return TB_ERR_MEM;
+            }
+            t->ids = ids;
+            if (!(free_ids = tb_realloc(t->free_ids, cap * sizeof(*free_ids))))
+            {
+                cluster_unlock();
+                return TB_ERR_MEM;
+            }
+            t->free_ids = free_ids;
+            t->cids = cap;
+        }
+        c = tb_malloc(sizeof(*c) + (nch + 1) * sizeof(*ch));
+        if (!c) {
+            cluster_unlock();
+            return TB_ERR_MEM;
+        }
+        c->hash = hash;
+        c->id = t->nfree > 0 ? t->free_ids[--t->nfree] : (uint32_t)t->nids++;
+        c->refs = 0;
+        c->nch = nch;
+        memcpy(c->ch, ch, nch * sizeof(*ch));
+        c->ch[nch] = '\0';
+        c->next = *bucket;
+        *bucket = c;
+        t->ids[c->id] = c;
+        t->nunused++;
+    }
+    if (c->refs++ == 0) {
+        t->nunused--;
+        t->nused++;
+    }
+    cluster_unlock();
+    *out = TB_CLUSTER_BIT | c->id;
     return TB_OK;
 }
 
-static int send_char(int x, int y, uint32_t ch) {
-    return send_cluster(x, y, &ch, 1);
+static struct cluster_t *cluster_find(uint32_t ch) {
+    // The cluster held by a cell with the given ch, or NULL if it holds a
+    // code point or an id not in use
+    struct cluster_t *c = NULL;
+    uint32_t id = ch & ~TB_CLUSTER_BIT;
+    if (!(ch & TB_CLUSTER_BIT) || ch == TB_SHADOW_CH) {
+        return NULL;
+    }
+    cluster_lock();
+    if (id < global.clusters.nids) {
+        c = global.clusters.ids[id];
+    }
+    cluster_unlock();
+    return c;
 }
 
-static int send_cluster(int x, int y, uint32_t *ch, size_t nch) {
-    int rv;
-    char abuf[8];
+static void cluster_hold(uint32_t ch) {
+    if (!(ch & TB_CLUSTER_BIT) || ch == TB_SHADOW_CH) {
+        return;
+    }
+    struct cluster_table_t *t = &global.clusters;
+    cluster_lock();
+    if (t->ids[ch & ~TB_CLUSTER_BIT]->refs++ == 0) {
+        t->nunused--;
+        t->nused++;
+    }
+    cluster_unlock();
+}
 
-    if (global.last_x != x - 1 || global.last_y != y) {
-        if_err_return(rv, send_cursor_if(x, y));
+static void cluster_drop(uint32_t ch) {
+    // Left in the table until cluster_sweep(), in case a cell takes it again
+    // meanwhile, e.g., when a frame is redrawn after tb_clear()
+    struct cluster_table_t *t = &global.clusters;
+    if (!(ch & TB_CLUSTER_BIT) || ch == TB_SHADOW_CH) {
+        return;
     }
-    global.last_x = x;
-    global.last_y = y;
+    cluster_lock();
+    if (--t->ids[ch & ~TB_CLUSTER_BIT]->refs == 0) {
+        t->nused--;
+        t->nunused++;
+    }
+    cluster_unlock();
+}
 
+static void cluster_sweep(int all) {
+    // Frees the clusters no cell holds, or all of them along with the ids
+    struct cluster_table_t *t = &global.clusters;
     int i;
-    for (i = 0; i < (int)nch; i++) {
-        uint32_t ach = *(ch + i);
-        int aw = tb_utf8_unicode_to_char(abuf, ach);
-        if (!ach) {
-            abuf[0] = ' ';
+    for (i = 0; i < TB_CLUSTER_BUCKETS; i++) {
+        struct cluster_t **link = &t->buckets[i];
+        while (*link) {
+            struct cluster_t *c = *link;
+            if (all || c->refs == 0) {
+                *link = c->next;
+                t->ids[c->id] = NULL;
+                t->free_ids[t->nfree++] = c->id;
+                tb_free(c);
+            } else {
+                link = &c->next;
+            }
         }
-        if_err_return(rv, bytebuf_nputs(&global.out, abuf, (size_t)aw));
     }
+    t->nunused = 0;
+    if (all) {
+        tb_free(t->ids);
+        tb_free(t->free_ids);
+        t->ids = NULL;
+        t->free_ids = NULL;
+        t->nids = 0;
+        t->nfree = 0;
+        t->cids = 0;
+        t->nused = 0;
+    }
+}
 
-    return TB_OK;
+static void cluster_lock(void) {
+#ifdef TB_OPT_RENDER_THREAD
+    // Cells of the back buffer and of the render thread's buffers change at
+    // the same time
+    if (global.render.running) {
+        pthread_mutex_lock(&global.clusters.lock);
+    }
+#endif
 }
 
-static int convert_num(uint32_t num, char *buf) {
-    int i, l = 0;
-    char ch;
-    do {
-        /* '0' = 48; 48 + num%10 < 58 < MAX_8bitCHAR */
-        buf[l++] = (char)('0' + (num % 10));
-        num /= 10;
-    } while (num);
-    for (i = 0; i < l / 2; i++) {
-        ch = buf[i];
-        buf[i] = buf[l - 1 - i];
-        buf[l - 1 - i] = ch;
+static void cluster_unlock(void) {
+#ifdef TB_OPT_RENDER_THREAD
+    if (global.render.running) {
+        pthread_mutex_unlock(&global.clusters.lock);
     }
-    return l;
+#endif
 }
+#endif
 
-static int cell_cmp(struct tb_cell *a, struct tb_cell *b) {
-    if (a->ch != b->ch || a->fg != b->fg || a->bg != b->bg) {
-        return 1;
+static void view_load(int i, int n) {
+    // Copies cells i to i + n of the back buffer to the copy handed out by
+    // tb_cell_buffer(), if any, with each cluster's code points as ech
+    struct cellbuf_t *back = &global.back;
+#if defined(TB_OPT_SOA) && defined(TB_OPT_EGC)
+    // Noting which clusters they hold for rows_store()
+    if (global.rows_ch) {
+        memcpy(&global.rows_ch[i], &back->ch[i], sizeof(uint32_t) * n);
+    }
+#endif
+#ifdef TB_CELL_VIEW
+    struct tb_cell *view = global.view;
+    if (!view) {
+        return;
     }
+    for (; n > 0; i++, n--) {
+        view[i].ch = cell_ch(back, i);
+        view[i].fg = cell_fg(back, i);
+        view[i].bg = cell_bg(back, i);
 #ifdef TB_OPT_EGC
-    if (a->nech != b->nech) {
-        return 1;
-    } else if (a->nech > 0) { // a->nech == b->nech
-        return memcmp(a->ech, b->ech, a->nech);
+        struct cluster_t *c = cluster_find(cell_ch(back, i));
+        view[i].ech = c ? c->ch : NULL;
+        view[i].nech = c ? c->nch : 0;
+        view[i].cech = 0;
+        if (c) {
+            view[i].ch = c->ch[0];
+        }
+#endif
     }
+#else
+    (void)back;
+    (void)i;
+    (void)n;
 #endif
-    return 0;
 }
 
-static int cell_copy(struct tb_cell *dst, struct tb_cell *src) {
-#ifdef TB_OPT_EGC
-    if (src->nech > 0) {
-        return cell_set(dst, src->ech, src->nech, src->fg, src->bg);
+static int view_store(void) {
+    // Takes in what the caller wrote to the copy handed out by
+    // tb_cell_buffer(). Functions changing the back buffer update the copy,
+    // so cells that differ from it were written by the caller. The copy is
+    // only scanned while the caller may have written to it.
+#ifdef TB_CELL_VIEW
+    int rv, i;
+#ifdef TB_OPT_SOA
+    if_err_return(rv, rows_store());
+#endif
+    if (!global.view_out) {
+        return TB_OK;
     }
+    for (i = 0; i < global.back.width * global.back.height; i++) {
+        if_err_return(rv, view_store_cell(i));
+    }
+    global.view_out = 0;
 #endif
-    return cell_set(dst, &src->ch, 1, src->fg, src->bg);
+    return TB_OK;
 }
 
-static int cell_set(struct tb_cell *cell, uint32_t *ch, size_t nch,
-    uintattr_t fg, uintattr_t bg) {
-    cell->ch = ch ? *ch : 0;
-    cell->fg = fg;
-    cell->bg = bg;
-#ifdef TB_OPT_EGC
-    if (nch <= 1) {
-        cell->nech = 0;
-    } else {
-        int rv;
-        if_err_return(rv, cell_reserve_ech(cell, nch + 1));
-        memcpy(cell->ech, ch, nch);
-        cell->ech[nch] = '\0';
-        cell->nech = nch;
+#ifdef TB_CELL_VIEW
+static int view_store_cell(int i) {
+    // Takes in cell i of the copy handed out by tb_cell_buffer() if the
+    // caller may have written to it and it differs from the back buffer
+    int rv;
+    struct cellbuf_t *back = &global.back;
+    struct tb_cell *view = global.view;
+    int w = back->width;
+    if (!view || !global.view_out) {
+        return TB_OK;
     }
+    if (view[i].fg == cell_fg(back, i) && view[i].bg == cell_bg(back, i)) {
+#ifdef TB_OPT_EGC
+        struct cluster_t *c = cluster_find(cell_ch(back, i));
+        if (c ? view[i].nech == c->nch && view[i].ech == c->ch &&
+                    view[i].ch == c->ch[0]
+              : view[i].nech == 0 && view[i].ch == cell_ch(back, i))
+        {
+            return TB_OK;
+        }
 #else
-    (void)nch;
-    (void)cell_reserve_ech;
+        if (view[i].ch == cell_ch(back, i)) {
+            return TB_OK;
+        }
+#endif
+    }
+#ifdef TB_OPT_EGC
+    if (view[i].nech > 0) {
+        if_err_return(rv, cell_set(back, i, view[i].ech, view[i].nech,
+                              view[i].fg, view[i].bg));
+    } else
 #endif
+    {
+        if_err_return(rv,
+            cell_set(back, i, &view[i].ch, 1, view[i].fg, view[i].bg));
+    }
+    back->widths[i] = 0;
+    if_err_return(rv, cellbuf_dirty(back, i % w, i / w, i % w, i / w));
+    view_load(i, 1);
     return TB_OK;
 }
+#endif
 
-static int cell_reserve_ech(struct tb_cell *cell, size_t n) {
-#ifdef TB_OPT_EGC
-    if (cell->cech >= n) {
+#ifdef TB_OPT_SOA
+static int rows_store(void) {
+    // Takes in what the caller wrote to the rows handed out by tb_cell_row(),
+    // which are already marked as changed. With TB_OPT_EGC, a cell whose ch
+    // changed from what view_load() noted drops the cluster it held and holds
+    // the one of its new ch, if any. The new ones are held first since the
+    // caller may have moved a cluster from one cell to another.
+    struct cellbuf_t *back = &global.back;
+    int w = back->width, y;
+    if (global.nrows_out == 0) {
         return TB_OK;
     }
-    if (!(cell->ech = tb_realloc(cell->ech, n * sizeof(cell->ch)))) {
-        return TB_ERR_MEM;
+#ifdef TB_OPT_EGC
+    int x;
+    uint32_t *ch = back->ch, *old = global.rows_ch;
+    for (y = 0; y < back->height; y++) {
+        for (x = y * w; global.rows_out[y] && x < (y + 1) * w; x++) {
+            if (ch[x] == old[x] || !(ch[x] & TB_CLUSTER_BIT) ||
+                ch[x] == TB_SHADOW_CH)
+            {
+                continue;
+            } else if (cluster_find(ch[x])) {
+                cluster_hold(ch[x]);
+            } else {
+                ch[x] = 0xfffd;
+            }
+        }
+    }
+    for (y = 0; y < back->height; y++) {
+        for (x = y * w; global.rows_out[y] && x < (y + 1) * w; x++) {
+            if (ch[x] != old[x]) {
+                cluster_drop(old[x]);
+            }
+        }
     }
-    cell->cech = n;
-    return TB_OK;
-#else
-    (void)cell;
-    (void)n;
-    return TB_ERR;
 #endif
+    for (y = 0; y < back->height; y++) {
+        if (global.rows_out[y]) {
+            memset(&back->widths[y * w], 0, w);
+            view_load(y * w, w);
+            global.rows_out[y] = 0;
+        }
+    }
+    global.nrows_out = 0;
+    return TB_OK;
 }
+#endif
 
-static int cell_free(struct tb_cell *cell) {
+static void view_free(void) {
+#ifdef TB_CELL_VIEW
+    tb_free(global.view);
+    global.view = NULL;
+    global.view_out = 0;
+#endif
+#ifdef TB_OPT_SOA
+    tb_free(global.rows_out);
+    global.rows_out = NULL;
+    global.nrows_out = 0;
 #ifdef TB_OPT_EGC
-    if (cell->ech) {
-        tb_free(cell->ech);
-    }
+    tb_free(global.rows_ch);
+    global.rows_ch = NULL;
+#endif
 #endif
-    memset(cell, 0, sizeof(*cell));
-    return TB_OK;
 }
 
 static int cellbuf_init(struct cellbuf_t *c, int w, int h) {
-    c->cells = tb_malloc(sizeof(struct tb_cell) * w * h);
+#ifdef TB_OPT_SOA
+    c->ch = tb_malloc(sizeof(*c->ch) * w * h);
+    c->fg = tb_malloc(sizeof(*c->fg) * w * h);
+    c->bg = tb_malloc(sizeof(*c->bg) * w * h);
+    if (!c->ch || !c->fg || !c->bg) {
+        tb_free(c->ch);
+        tb_free(c->fg);
+        tb_free(c->bg);
+        c->ch = NULL;
+        c->fg = NULL;
+        c->bg = NULL;
+        return TB_ERR_MEM;
+    }
+#else
+    c->cells = tb_malloc(sizeof(struct cell_t) * w * h);
     if (!c->cells) {
         return TB_ERR_MEM;
     }
-    memset(c->cells, 0, sizeof(struct tb_cell) * w * h);
+#endif
+    c->dirty = tb_malloc(sizeof(struct cellspan_t) * h);
+    c->widths = tb_malloc(w * h);
+    c->hashes = tb_malloc(sizeof(uint32_t) * h);
+    if (!c->dirty || !c->widths || !c->hashes) {
+#ifdef TB_OPT_SOA
+        tb_free(c->ch);
+        tb_free(c->fg);
+        tb_free(c->bg);
+        c->ch = NULL;
+        c->fg = NULL;
+        c->bg = NULL;
+#else
+        tb_free(c->cells);
+        c->cells = NULL;
+#endif
+        tb_free(c->dirty);
+        tb_free(c->widths);
+        tb_free(c->hashes);
+        c->dirty = NULL;
+        c->widths = NULL;
+        c->hashes = NULL;
+        return TB_ERR_MEM;
+    }
+#ifdef TB_OPT_SOA
+    memset(c->ch, 0, sizeof(*c->ch) * w * h);
+    memset(c->fg, 0, sizeof(*c->fg) * w * h);
+    memset(c->bg, 0, sizeof(*c->bg) * w * h);
+#else
+    memset(c->cells, 0, sizeof(struct cell_t) * w * h);
+#endif
+    memset(c->widths, 0, w * h);
+    memset(c->hashes, 0, sizeof(uint32_t) * h);
     c->width = w;
     c->height = h;
-    return TB_OK;
+    c->cap = w * h;
+    c->rows_cap = h;
+    return cellbuf_dirty_all(c);
 }
 
 static int cellbuf_free(struct cellbuf_t *c) {
+    int i;
+#ifdef TB_OPT_SOA
+    if (c->ch) {
+        for (i = 0; i < c->width * c->height; i++) {
+            cell_free(c, i);
+        }
+        tb_free(c->ch);
+        tb_free(c->fg);
+        tb_free(c->bg);
+    }
+#else
     if (c->cells) {
-        int i;
         for (i = 0; i < c->width * c->height; i++) {
-            cell_free(&c->cells[i]);
+            cell_free(c, i);
         }
         tb_free(c->cells);
     }
+#endif
+    if (c->dirty) {
+        tb_free(c->dirty);
+    }
+    if (c->widths) {
+        tb_free(c->widths);
+    }
+    if (c->hashes) {
+        tb_free(c->hashes);
+    }
     memset(c, 0, sizeof(*c));
     return TB_OK;
 }
 
 static int cellbuf_clear(struct cellbuf_t *c) {
-    int rv, i;
-    uint32_t space = (uint32_t)' ';
-    for (i = 0; i < c->width * c->height; i++) {
-        if_err_return(rv,
-            cell_set(&c->cells[i], &space, 1, global.fg, global.bg));
+    cellbuf_fill(c, 0, c->width * c->height, global.fg, global.bg);
+    return cellbuf_dirty_all(c);
+}
+
+static void cellbuf_fill(struct cellbuf_t *c, int i, int n, uintattr_t fg,
+    uintattr_t bg) {
+    // Blanks cells i to i + n, dropping the clusters they held
+    cellbuf_drop(c, i, n);
+    cellbuf_blank(c, i, n, fg, bg);
+}
+
+static void cellbuf_blank(struct cellbuf_t *c, int i, int n, uintattr_t fg,
+    uintattr_t bg) {
+    // Blanks cells i to i + n whatever they held. With TB_OPT_SOA, the loop
+    // stores to each array in turn and is vectorized.
+    int end = i + n;
+    if (n < 1) {
+        return;
     }
-    return TB_OK;
+    memset(&c->widths[i], 1, (size_t)n);
+    for (; i < end; i++) {
+        cell_ch(c, i) = (uint32_t)' ';
+        cell_fg(c, i) = fg;
+        cell_bg(c, i) = bg;
+    }
+}
+
+static void cellbuf_drop(struct cellbuf_t *c, int i, int n) {
+    // Drops the clusters held by cells i to i + n, leaving the cells as is
+#ifdef TB_OPT_EGC
+    int end = i + n;
+    for (; i < end; i++) {
+        if (cell_has_cluster(c, i)) {
+            cluster_drop(cell_ch(c, i));
+        }
+    }
+#else
+    (void)c;
+    (void)i;
+    (void)n;
+#endif
+}
+
+static void cellbuf_move(struct cellbuf_t *c, int dst, int src, int n) {
+    // Moves cells src to src + n to dst, along with the clusters they hold
+    size_t len = (size_t)n;
+#ifdef TB_OPT_SOA
+    memmove(&c->ch[dst], &c->ch[src], sizeof(*c->ch) * len);
+    memmove(&c->fg[dst], &c->fg[src], sizeof(*c->fg) * len);
+    memmove(&c->bg[dst], &c->bg[src], sizeof(*c->bg) * len);
+#else
+    memmove(&c->cells[dst], &c->cells[src], sizeof(struct cell_t) * len);
+#endif
+    memmove(&c->widths[dst], &c->widths[src], len);
 }
 
-static int cellbuf_get(struct cellbuf_t *c, int x, int y,
-    struct tb_cell **out) {
+static int cellbuf_get(struct cellbuf_t *c, int x, int y, int *out) {
     if (x < 0 || x >= c->width || y < 0 || y >= c->height) {
-        *out = NULL;
+        *out = -1;
         return TB_ERR_OUT_OF_BOUNDS;
     }
-    *out = &c->cells[(y * c->width) + x];
+    *out = (y * c->width) + x;
     return TB_OK;
 }
 
+static int cellbuf_set(struct cellbuf_t *c, int x, int y, uint32_t *ch,
+    size_t nch, uintattr_t fg, uintattr_t bg, int w) {
+    int rv, i;
+    if_err_return(rv, cellbuf_get(c, x, y, &i));
+    if_err_return(rv, cell_set(c, i, ch, nch, fg, bg));
+    if (w < 0) {
+        w = cell_width(c, i);
+    }
+    c->widths[i] = w < 1 ? 1 : w > UINT8_MAX ? UINT8_MAX : w;
+    return cellbuf_dirty(c, x, y, x, y);
+}
+
 static int cellbuf_resize(struct cellbuf_t *c, int w, int h) {
-    int rv;
+    // Rows are moved within the same storage, keeping the clusters their cells
+    // hold, and only the cells exposed are blanked. Storage grows with room to
+    // spare and is given back once mostly unused, so dragging the window
+    // edge seldom allocates.
+    int rv, y;
 
     int ow = c->width;
     int oh = c->height;
 
+    w = w < 1 ? 1 : w;
+    h = h < 1 ? 1 : h;
+
     if (ow == w && oh == h) {
         return TB_OK;
     }
 
-    w = w < 1 ? 1 : w;
-    h = h < 1 ? 1 : h;
-
     int minw = (w < ow) ? w : ow;
     int minh = (h < oh) ? h : oh;
+    int n = w * h;
 
-    struct tb_cell *prev = c->cells;
-
-    if_err_return(rv, cellbuf_init(c, w, h));
-    if_err_return(rv, cellbuf_clear(c));
+    if (n > c->cap || h > c->rows_cap) {
+        if_err_return(rv,
+            cellbuf_realloc(c, n > c->cap ? n + n / 2 : c->cap,
+                h > c->rows_cap ? h + h / 2 : c->rows_cap));
+    }
 
-    int x, y;
-    for (x = 0; x < minw; x++) {
+    if (h < oh) {
+        cellbuf_drop(c, h * ow, (oh - h) * ow);
+    }
+    if (w < ow) {
         for (y = 0; y < minh; y++) {
-            struct tb_cell *src, *dst;
-            src = &prev[(y * ow) + x];
-            if_err_return(rv, cellbuf_get(c, x, y, &dst));
-            if_err_return(rv, cell_copy(dst, src));
+            cellbuf_drop(c, (y * ow) + w, ow - w);
+        }
+    }
+
+    // Moving rows apart starts from the last one, together from the first
+    if (w > ow) {
+        for (y = minh - 1; y >= 0; y--) {
+            cellbuf_move(c, y * w, y * ow, minw);
+            cellbuf_blank(c, (y * w) + ow, w - ow, global.fg, global.bg);
+        }
+    } else if (w < ow) {
+        for (y = 1; y < minh; y++) {
+            cellbuf_move(c, y * w, y * ow, minw);
+        }
+    }
+    if (h > oh) {
+        cellbuf_blank(c, oh * w, (h - oh) * w, global.fg, global.bg);
+    }
+
+    c->width = w;
+    c->height = h;
+    memset(c->hashes, 0, sizeof(uint32_t) * h);
+
+    if (n < c->cap / 4 || h < c->rows_cap / 4) {
+        // Failing to give memory back leaves the buffer as it was
+        cellbuf_realloc(c, n < c->cap / 4 ? n : c->cap,
+            h < c->rows_cap / 4 ? h : c->rows_cap);
+    }
+
+    return cellbuf_dirty_all(c);
+}
+
+static int cellbuf_realloc(struct cellbuf_t *c, int cap, int rows_cap) {
+    // Sets the storage to cap cells and rows_cap rows, keeping the cells and
+    // rows that fit. On failure, every array still holds at least c->cap
+    // cells and c->rows_cap rows.
+    void *p;
+    if (cap < c->cap) {
+        c->cap = cap;
+    }
+    if (rows_cap < c->rows_cap) {
+        c->rows_cap = rows_cap;
+    }
+#ifdef TB_OPT_SOA
+    if (!(p = tb_realloc(c->ch, sizeof(*c->ch) * cap))) {
+        return TB_ERR_MEM;
+    }
+    c->ch = p;
+    if (!(p = tb_realloc(c->fg, sizeof(*c->fg) * cap))) {
+        return TB_ERR_MEM;
+    }
+    c->fg = p;
+    if (!(p = tb_realloc(c->bg, sizeof(*c->bg) * cap))) {
+        return TB_ERR_MEM;
+    }
+    c->bg = p;
+#else
+    if (!(p = tb_realloc(c->cells, sizeof(struct cell_t) * cap))) {
+        return TB_ERR_MEM;
+    }
+    c->cells = p;
+#endif
+    if (!(p = tb_realloc(c->widths, cap))) {
+        return TB_ERR_MEM;
+    }
+    c->widths = p;
+    c->cap = cap;
+    if (!(p = tb_realloc(c->dirty, sizeof(struct cellspan_t) * rows_cap))) {
+        return TB_ERR_MEM;
+    }
+    c->dirty = p;
+    if (!(p = tb_realloc(c->hashes, sizeof(uint32_t) * rows_cap))) {
+        return TB_ERR_MEM;
+    }
+    c->hashes = p;
+    c->rows_cap = rows_cap;
+    return TB_OK;
+}
+
+static int cellbuf_dirty(struct cellbuf_t *c, int x0, int y0, int x1, int y1) {
+    int y;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 >= c->width ? c->width - 1 : x1;
+    y1 = y1 >= c->height ? c->height - 1 : y1;
+    for (y = y0; y <= y1; y++) {
+        struct cellspan_t *span = &c->dirty[y];
+        if (x0 < span->x0)
+            span->x0 = x0;
+        if (x1 > span->x1)
+            span->x1 = x1;
+    }
+    return TB_OK;
+}
+
+static int cellbuf_dirty_all(struct cellbuf_t *c) {
+    int y;
+    for (y = 0; y < c->height; y++) {
+        c->dirty[y].x0 = 0;
+        c->dirty[y].x1 = c->width - 1;
+    }
+    return TB_OK;
+}
+
+#ifdef TB_OPT_RENDER_THREAD
+static int cellbuf_copy_dirty(struct cellbuf_t *dst, struct cellbuf_t *src) {
+    // Copies the changed columns of each row, adding them to dst's changes
+    int rv, x, y;
+    for (y = 0; y < src->height && y < dst->height; y++) {
+        struct cellspan_t *span = &src->dirty[y];
+        int x1 = span->x1 < dst->width ? span->x1 : dst->width - 1;
+        for (x = span->x0; x <= x1; x++) {
+            if_err_return(rv, cell_copy(dst, y * dst->width + x, src,
+                                  y * src->width + x));
+            dst->widths[y * dst->width + x] = src->widths[y * src->width + x];
+        }
+        if (span->x0 <= x1) {
+            if_err_return(rv, cellbuf_dirty(dst, span->x0, y, x1, y));
+        }
+        span->x0 = src->width;
+        span->x1 = -1;
+    }
+    return TB_OK;
+}
+#endif
+
+static int cellbuf_hash_rows(struct cellbuf_t *c, int y0, int y1) {
+    // FNV-1a over (ch, fg, bg). This only narrows down candidate rows, equality
+    // is checked with cellbuf_row_eq(). Columns covered by a wide cell are
+    // left out, since they hold shadow cells in the front buffer and whatever
+    // was written there in the back buffer.
+    int x, y, n;
+    int front = c == &global.front;
+    for (y = y0; y <= y1; y++) {
+        int row = y * c->width;
+        uint32_t hash = 2166136261u;
+        for (x = row; x < row + c->width; x += n) {
+            n = 1;
+            if (front) {
+                if (cell_ch(c, x) == TB_SHADOW_CH) {
+                    continue;
+                }
+            } else if ((n = c->widths[x]) == 0) {
+                n = c->widths[x] = cell_width(c, x);
+            }
+            hash = (hash ^ cell_ch(c, x)) * 16777619u;
+            hash = (hash ^ (uint32_t)cell_fg(c, x)) * 16777619u;
+            hash = (hash ^ (uint32_t)cell_bg(c, x)) * 16777619u;
+        }
+        c->hashes[y] = hash;
+    }
+    return TB_OK;
+}
+
+static int cellbuf_row_eq(struct cellbuf_t *a, int ay, struct cellbuf_t *b,
+    int by) {
+    // Whether back row ay of a shows as front row by of b. A shadow cell of b
+    // is taken as equal to the cell of a it covers: the cells left of it are
+    // equal, so the wide cell covering it in b covers it in a too.
+    int w = a->width, x = 0;
+    for (;;) {
+        x += cell_run_cmp(a, ay * w + x, b, by * w + x, w - x);
+        if (x >= w) {
+            return 1;
+        } else if (cell_ch(b, by * w + x) != TB_SHADOW_CH) {
+            return 0;
         }
+        x++;
+    }
+}
+
+static int cellbuf_row_uniform(struct cellbuf_t *c, int y) {
+    int row = y * c->width;
+    return cell_run_cmp(c, row + 1, c, row, c->width - 1) == c->width - 1;
+}
+
+static void cellbuf_row_key(struct cellbuf_t *c, int y, char *key) {
+    // Copies row y as w * TB_CELL_KEY_LEN bytes of plain data, see
+    // row_cache_find()
+    size_t n = (size_t)c->width;
+    int row = y * c->width;
+#ifdef TB_OPT_SOA
+    memcpy(key, &c->ch[row], sizeof(*c->ch) * n);
+    key += sizeof(*c->ch) * n;
+    memcpy(key, &c->fg[row], sizeof(*c->fg) * n);
+    key += sizeof(*c->fg) * n;
+    memcpy(key, &c->bg[row], sizeof(*c->bg) * n);
+#else
+    memcpy(key, &c->cells[row], sizeof(struct cell_t) * n);
+#endif
+}
+
+static int cellbuf_row_key_eq(struct cellbuf_t *c, int y, const char *key) {
+    // Whether row y is the one cellbuf_row_key() copied to key
+    size_t n = (size_t)c->width;
+    int row = y * c->width;
+#ifdef TB_OPT_SOA
+    if (memcmp(key, &c->ch[row], sizeof(*c->ch) * n) != 0) {
+        return 0;
+    }
+    key += sizeof(*c->ch) * n;
+    if (memcmp(key, &c->fg[row], sizeof(*c->fg) * n) != 0) {
+        return 0;
     }
+    key += sizeof(*c->fg) * n;
+    return memcmp(key, &c->bg[row], sizeof(*c->bg) * n) == 0;
+#else
+    return memcmp(key, &c->cells[row], sizeof(struct cell_t) * n) == 0;
+#endif
+}
 
-    tb_free(prev);
+static void cellbuf_swap_cells(struct cellbuf_t *a, struct cellbuf_t *b) {
+    // Swaps the cells of two buffers of the same size, leaving the rest
+#ifdef TB_OPT_SOA
+    uint32_t *ch = a->ch;
+    uintattr_t *fg = a->fg, *bg = a->bg;
+    a->ch = b->ch;
+    a->fg = b->fg;
+    a->bg = b->bg;
+    b->ch = ch;
+    b->fg = fg;
+    b->bg = bg;
+#else
+    struct cell_t *cells = a->cells;
+    a->cells = b->cells;
+    b->cells = cells;
+#endif
+}
 
+static int cellbuf_reverse_rows(struct cellbuf_t *c, int y0, int y1) {
+    int x;
+    for (; y0 < y1; y0++, y1--) {
+        int a = y0 * c->width, b = y1 * c->width;
+        for (x = 0; x < c->width; x++, a++, b++) {
+            uint32_t tmpch = cell_ch(c, a);
+            uintattr_t tmpfg = cell_fg(c, a), tmpbg = cell_bg(c, a);
+            uint8_t tmpw = c->widths[a];
+            cell_ch(c, a) = cell_ch(c, b);
+            cell_fg(c, a) = cell_fg(c, b);
+            cell_bg(c, a) = cell_bg(c, b);
+            c->widths[a] = c->widths[b];
+            cell_ch(c, b) = tmpch;
+            cell_fg(c, b) = tmpfg;
+            cell_bg(c, b) = tmpbg;
+            c->widths[b] = tmpw;
+        }
+        uint32_t tmph = c->hashes[y0];
+        c->hashes[y0] = c->hashes[y1];
+        c->hashes[y1] = tmph;
+        struct cellspan_t tmpd = c->dirty[y0];
+        c->dirty[y0] = c->dirty[y1];
+        c->dirty[y1] = tmpd;
+    }
     return TB_OK;
 }
 
+static int cellbuf_scroll(struct cellbuf_t *c, int top, int bot, int n,
+    uintattr_t fg, uintattr_t bg) {
+    // Move rows [top, bot] up by n (down if negative), blanking the rows that
+    // become exposed. Rows are rotated rather than copied so each cluster
+    // keeps the count of cells holding it.
+    int k = n > 0 ? n : bot - top + 1 + n;
+    cellbuf_reverse_rows(c, top, top + k - 1);
+    cellbuf_reverse_rows(c, top + k, bot);
+    cellbuf_reverse_rows(c, top, bot);
+
+    int y0 = n > 0 ? bot - n + 1 : top;
+    int y1 = n > 0 ? bot : top - n - 1;
+    cellbuf_fill(c, y0 * c->width, (y1 - y0 + 1) * c->width, fg, bg);
+    return cellbuf_hash_rows(c, y0, y1);
+}
+
 static int bytebuf_puts(struct bytebuf_t *b, const char *str) {
     return bytebuf_nputs(b, str, (size_t)strlen(str));
 }
@@ -3239,16 +7251,38 @@ static int bytebuf_shift(struct bytebuf_t *b, size_t n) {
 }
 
 static int bytebuf_flush(struct bytebuf_t *b, int fd) {
-    if (b->len <= 0) {
-        return TB_OK;
+    // Write everything, waiting for the fd if it's non-blocking
+    int rv;
+    while ((rv = bytebuf_flush_nonblock(b, fd)) == TB_ERR_WOULD_BLOCK) {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        if (select(fd + 1, NULL, &fds, NULL, NULL) < 0 && errno != EINTR) {
+            global.last_errno = errno;
+            return TB_ERR_POLL;
+        }
     }
-    ssize_t write_rv = write(fd, b->buf, b->len);
-    if (write_rv < 0 || (size_t)write_rv != b->len) {
-        // Note, errno will be 0 on partial write
-        global.last_errno = errno;
-        return TB_ERR;
+    return rv;
+}
+
+static int bytebuf_flush_nonblock(struct bytebuf_t *b, int fd) {
+    // Write as much as the fd takes, resuming after earlier partial writes.
+    // Only a non-blocking fd can leave some for later.
+    while (b->off < b->len) {
+        ssize_t write_rv = write(fd, b->buf + b->off, b->len - b->off);
+        if (write_rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return TB_ERR_WOULD_BLOCK;
+            }
+            global.last_errno = errno;
+            return TB_ERR;
+        }
+        b->off += (size_t)write_rv;
     }
     b->len = 0;
+    b->off = 0;
     return TB_OK;
 }
 
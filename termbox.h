@@ -43,6 +43,7 @@ SOFTWARE.
 #include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,9 +54,19 @@ SOFTWARE.
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
+// Diff threads take the same locks as the render thread
+#if defined(TB_OPT_DIFF_THREADS) && !defined(TB_OPT_RENDER_THREAD)
+#define TB_OPT_RENDER_THREAD
+#endif
+
+#ifdef TB_OPT_RENDER_THREAD
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -198,6 +209,11 @@ extern "C" {
 /* Some hard-coded caps */
 #define TB_HARDCAP_ENTER_MOUSE  "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define TB_HARDCAP_EXIT_MOUSE   "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
+#define TB_HARDCAP_RESET_SCROLL_REGION "\x1b[r"
+#define TB_HARDCAP_REVERSE_INDEX       "\x1bM"
+#define TB_HARDCAP_BEGIN_SYNC          "\x1b[?2026h"
+#define TB_HARDCAP_END_SYNC            "\x1b[?2026l"
+#define TB_HARDCAP_QUERY_SYNC          "\x1b[?2026$p"
 
 /* Colors (numeric) and attributes (bitwise) (tb_cell.fg, tb_cell.bg) */
 #define TB_BLACK                0x0001
@@ -250,6 +266,25 @@ extern "C" {
 #define TB_OUTPUT_TRUECOLOR 5
 #endif
 
+/* Present modes (bitwise) (tb_set_present_mode) */
+#define TB_PRESENT_CURRENT  0
+#define TB_PRESENT_NORMAL   1
+#define TB_PRESENT_SCROLL   2
+#define TB_PRESENT_REPAINT  4
+#define TB_PRESENT_REDRAW   8
+
+/* Synchronized output modes (tb_set_sync_mode) */
+#define TB_SYNC_CURRENT     0
+#define TB_SYNC_AUTO        1
+#define TB_SYNC_ON          2
+#define TB_SYNC_OFF         3
+
+/* Flush modes (tb_set_flush_mode) */
+#define TB_FLUSH_CURRENT    0
+#define TB_FLUSH_BLOCKING   1
+#define TB_FLUSH_APPEND     2
+#define TB_FLUSH_COALESCE   3
+
 /* Common function return values unless otherwise noted.
  *
  * Library behavior is undefined after receiving TB_ERR_MEM. Callers may
@@ -279,6 +314,7 @@ extern "C" {
 #define TB_ERR_RESIZE_READ      -20
 #define TB_ERR_RESIZE_SSCANF    -21
 #define TB_ERR_CAP_COLLISION    -22
+#define TB_ERR_WOULD_BLOCK      -23
 
 #define TB_ERR_SELECT           TB_ERR_POLL
 #define TB_ERR_RESIZE_SELECT    TB_ERR_RESIZE_POLL
@@ -328,7 +364,8 @@ typedef uint16_t uintattr_t;
  * however some support for grapheme clusters (e.g., combining diacritical
  * marks) and wide code points (e.g., Hiragana) is provided through ech, nech,
  * cech via tb_set_cell_ex(). ech is only valid when nech>0, otherwise ch is
- * used.
+ * used. Cells holding the same cluster point to the same read-only ech, owned
+ * by termbox.
  *
  * For non-single-width code points, given N=wcwidth(ch)/wcswidth(ech):
  *
@@ -349,9 +386,9 @@ struct tb_cell {
     uintattr_t fg; /* bitwise foreground attributes */
     uintattr_t bg; /* bitwise background attributes */
 #ifdef TB_OPT_EGC
-    uint32_t *ech; /* a grapheme cluster of Unicode code points */
+    uint32_t *ech; /* a grapheme cluster of Unicode code points, shared */
     size_t nech;   /* length in bytes of ech, 0 means use ch instead of ech */
-    size_t cech;   /* capacity in bytes of ech */
+    size_t cech;   /* unused, always 0 */
 #endif
 };
 
@@ -379,6 +416,35 @@ struct tb_event {
     int32_t y;    /* mouse y */
 };
 
+/* Statistics about the most recent tb_present() call. See tb_get_stats(). */
+struct tb_stats {
+    size_t bytes;            /* bytes written to the tty */
+    size_t cells;            /* cells sent */
+    size_t cursor_moves;     /* cursor motions sent */
+    size_t cursor_bytes;     /* bytes spent on cursor motion */
+    size_t sgr_cache_hits;   /* attribute changes sent from the cache */
+    size_t sgr_cache_misses; /* attribute changes encoded from scratch */
+    int synchronized;        /* 1 if wrapped in synchronized output */
+    int repainted;           /* 1 if the screen was cleared and redrawn */
+    int deferred;            /* 1 if held back by output pending or pacing */
+    size_t pending;          /* bytes not yet written to the tty */
+    size_t frames_merged;    /* frames held back since tb_init() */
+    size_t frames_dropped;   /* held-back frames overwritten by a later one */
+    int rows_left;           /* changed rows left over the present budget */
+    size_t row_cache_hits;   /* rows sent from the row cache */
+    size_t row_cache_misses; /* whole rows encoded from scratch */
+    size_t row_cache_bytes;  /* memory held by the row cache */
+};
+
+/* Cost of the next frame, see tb_present_estimate() */
+struct tb_present_cost {
+    size_t bytes;        /* bytes that would be written to the tty */
+    size_t cells;        /* cells that would be sent */
+    size_t cursor_moves; /* cursor motions that would be sent */
+    size_t sgr_changes;  /* attribute changes that would be sent */
+    int rows_left;       /* changed rows that would be left over the budget */
+};
+
 /* Initializes the termbox library. This function should be called before any
  * other functions. tb_init() is equivalent to tb_init_file("/dev/tty"). After
  * successful initialization, the library must be finalized using the
@@ -405,10 +471,64 @@ int tb_height(void);
 int tb_clear(void);
 int tb_set_clear_attrs(uintattr_t fg, uintattr_t bg);
 
-/* Synchronizes the internal back buffer with the terminal by writing to tty. */
+/* Synchronizes the internal back buffer with the terminal by writing to tty.
+ *
+ * Only the columns changed since the previous tb_present() are examined.
+ * Changes are tracked by tb_set_cell(), tb_set_cell_ex(), tb_extend_cell(),
+ * tb_clear(), and resizes. Calling tb_cell_buffer() marks the whole buffer as
+ * changed; callers that keep the returned pointer across presents must call
+ * tb_invalidate() after writing to it. With TB_OPT_EGC or TB_OPT_SOA, it
+ * returns a copy of the back buffer, which is taken in by the next present or
+ * tb_invalidate().
+ *
+ * Runs of identical cells are sent as erase-to-end-of-line, ECH or REP when
+ * the terminal's terminfo entry has el, ech or rep and that is shorter.
+ * Attribute changes between cells only send what differs from the previous
+ * cell when the terminal's attribute caps are the ECMA-48 SGR sequences.
+ */
 int tb_present(void);
 
-/* Sets the position of the cursor. Upper-left character is (0, 0). */
+/* Like tb_present(), but only sends changes inside the given rectangle, e.g.,
+ * the one pane that changed. Wide characters straddling its left or right
+ * edge are sent whole. Changes outside the rectangle stay pending for a later
+ * present. Scrolling and repainting (see tb_set_present_mode()) are only done
+ * by tb_present(). If the render thread is running, the whole frame is handed
+ * off as by tb_present().
+ *
+ * With tb_set_max_fps(), a region counts as a frame. One sent too soon after
+ * the previous frame holds back the whole frame as tb_present() would, and
+ * one sent while a frame is held back and due sends the whole frame.
+ *
+ * The rectangle is clipped to the screen. TB_ERR_OUT_OF_BOUNDS is returned if
+ * nothing is left of it.
+ */
+int tb_present_region(int x, int y, int w, int h);
+
+/* Fills cost with what tb_present() would send for the current back buffer,
+ * without sending anything or changing what the next tb_present() does. An
+ * app can use it to, e.g., drop detail from a frame that would take too long
+ * over a slow link. Output still pending from earlier frames and frames held
+ * back by tb_set_max_fps() aren't taken into account: the cost is that of the
+ * frame when it's sent.
+ *
+ * This encodes the frame like tb_present() does, so it costs about as much as
+ * a present minus the write.
+ */
+int tb_present_estimate(struct tb_present_cost *cost);
+
+/* Marks the entire internal back buffer as changed, forcing the next
+ * tb_present() to compare every cell against the terminal.
+ */
+int tb_invalidate(void);
+
+/* Fills stats with statistics about the most recent tb_present() call. */
+int tb_get_stats(struct tb_stats *stats);
+
+/* Sets the position of the cursor. Upper-left character is (0, 0).
+ *
+ * Like cursor motion in tb_present(), this uses the shortest sequence that
+ * gets there from the last known position, which is lost after tb_send().
+ */
 int tb_set_cursor(int cx, int cy);
 int tb_hide_cursor(void);
 
@@ -428,6 +548,30 @@ int tb_set_cell_ex(int x, int y, uint32_t *ch, size_t nch, uintattr_t fg,
     uintattr_t bg);
 int tb_extend_cell(int x, int y, uint32_t ch);
 
+/* Sets ch, fg and bg to row y of the internal back buffer, which holds each
+ * field of its cells in a separate array when termbox is compiled with
+ * TB_OPT_SOA. Returns TB_ERR otherwise.
+ *
+ * The row is written directly, e.g., a whole row of colors at once, and marked
+ * as changed. The pointers stay valid until the next present, resize, or call
+ * to tb_cell_buffer(), tb_invalidate() or tb_extend_cell(); get the row again
+ * after any of these. With TB_OPT_EGC, a cell holding a grapheme cluster has
+ * its top bit set in ch, and copying its ch to another cell of these rows
+ * copies the cluster. Other values with the top bit set are taken as U+FFFD.
+ */
+int tb_cell_row(int y, uint32_t **ch, uintattr_t **fg, uintattr_t **bg);
+
+/* Copies a w by h rectangle of cells to the internal back buffer at x, y, as
+ * many calls to tb_set_cell_ex() would, e.g., a panel built in the caller's
+ * memory. Row r of the rectangle starts at src[r * src_stride]. With
+ * TB_OPT_EGC, a cell with nech > 0 sets the grapheme cluster in ech.
+ *
+ * The rectangle is clipped to the screen. TB_ERR_OUT_OF_BOUNDS is returned if
+ * nothing is left of it, and TB_ERR if src_stride is less than w.
+ */
+int tb_blit(int x, int y, int w, int h, const struct tb_cell *src,
+    int src_stride);
+
 /* Sets the input mode. Termbox has two input modes:
  *
  * 1. TB_INPUT_ESC
@@ -525,6 +669,192 @@ int tb_set_input_mode(int mode);
  */
 int tb_set_output_mode(int mode);
 
+/* Sets the present mode, i.e., which optimizations tb_present() may use when
+ * updating the terminal. TB_PRESENT_NORMAL is always on, and the following
+ * may be applied via bitwise OR operation:
+ *
+ * 1. TB_PRESENT_SCROLL
+ *    Detect blocks of rows that moved up or down since the last present (e.g.,
+ *    a scrolling log pane) and shift them on the terminal with a scroll region
+ *    instead of redrawing them. Only the newly exposed rows are then sent.
+ *    Requires the change_scroll_region (csr) capability.
+ *
+ * 2. TB_PRESENT_REPAINT
+ *    When most of the screen changed (e.g., a page flip), clear it and stream
+ *    every row from the top instead of updating changed cells one by one,
+ *    whichever is estimated to send fewer bytes. tb_get_stats() reports
+ *    which way each frame was sent.
+ *
+ * 3. TB_PRESENT_REDRAW
+ *    Declares that the caller redraws every cell before each tb_present(),
+ *    e.g., an immediate mode UI calling tb_clear() and drawing the whole
+ *    screen each frame. Instead of copying every cell sent into the front
+ *    buffer, a frame presented whole swaps the back and front buffers, so the
+ *    back buffer then holds an older frame until it is redrawn. The pointer
+ *    returned by tb_cell_buffer() may change on each present.
+ *
+ * Modes not supported by the terminal are dropped. If mode is
+ * TB_PRESENT_CURRENT, the function returns the current present mode, which can
+ * be used to check what took effect.
+ *
+ * The default present mode is TB_PRESENT_NORMAL.
+ */
+int tb_set_present_mode(int mode);
+
+/* Sets whether tb_present() wraps each frame in synchronized output (DEC
+ * private mode 2026), so the terminal renders the frame at once instead of
+ * repainting while it arrives. Available modes:
+ *
+ * 1. TB_SYNC_AUTO
+ *    Synchronize if the terminal supports it. tb_init() asks the terminal
+ *    (DECRQM) and its reply is read by tb_peek_event() and tb_poll_event(), so
+ *    frames are synchronized from the first event poll after the reply.
+ *
+ * 2. TB_SYNC_ON
+ *    Always synchronize. Terminals without support ignore the mode.
+ *
+ * 3. TB_SYNC_OFF
+ *    Never synchronize.
+ *
+ * If mode is TB_SYNC_CURRENT, the function returns the current sync mode. Use
+ * tb_get_stats() to check whether the last frame was synchronized.
+ *
+ * The default sync mode is TB_SYNC_AUTO.
+ */
+int tb_set_sync_mode(int mode);
+
+/* Sets how output is written to the terminal. Available modes:
+ *
+ * 1. TB_FLUSH_BLOCKING
+ *    tb_present() returns once the whole frame is written.
+ *
+ * 2. TB_FLUSH_APPEND
+ *    tb_present() writes as much as the terminal takes without blocking and
+ *    returns TB_ERR_WOULD_BLOCK if some of the frame is still pending. The
+ *    next frame is appended to what is pending.
+ *
+ * 3. TB_FLUSH_COALESCE
+ *    Like TB_FLUSH_APPEND, but while output is pending tb_present() only
+ *    tries to write it and leaves the new changes in the back buffer. They
+ *    are sent, merged, by the first tb_present() after the output drained.
+ *
+ * In the non-blocking modes, poll the fd from tb_get_pending() for writing
+ * and call tb_flush() or tb_present() when it's ready. The fd is put in
+ * non-blocking mode until TB_FLUSH_BLOCKING is set again or tb_shutdown().
+ * Functions other than tb_present() and tb_flush() still block until all
+ * output is written.
+ *
+ * If mode is TB_FLUSH_CURRENT, the function returns the current flush mode.
+ *
+ * The default flush mode is TB_FLUSH_BLOCKING.
+ */
+int tb_set_flush_mode(int mode);
+
+/* Writes pending output without blocking (unless in TB_FLUSH_BLOCKING mode).
+ * Returns TB_OK if everything was written, or TB_ERR_WOULD_BLOCK if some
+ * output is still pending.
+ */
+int tb_flush(void);
+
+/* Gets the fd termbox writes to and the number of bytes still pending. */
+int tb_get_pending(int *wfd, size_t *pending);
+
+/* Limits how often tb_present() sends a frame to at most fps per second.
+ * A tb_present() sooner than that after the previous frame sends nothing and
+ * holds the frame back. It's sent, together with any changes made in the
+ * meantime, once the interval is over: by tb_peek_event() or tb_poll_event(),
+ * which wake up for it, or by the next tb_present(). tb_get_stats() counts
+ * the frames merged this way and how many of them were never shown.
+ *
+ * If fps is 0, pacing is disabled and a held-back frame is sent right away.
+ * If fps is negative, the function returns the current limit. Pacing is
+ * disabled by default.
+ */
+int tb_set_max_fps(int fps);
+
+/* Returns the number of milliseconds until a held-back frame is due, 0 if it
+ * is due now, or -1 if no frame is held back. Useful when polling the fds
+ * from tb_get_fds() instead of calling tb_peek_event(); call tb_present()
+ * when it's due.
+ */
+int tb_frame_due_ms(void);
+
+/* Limits how many bytes tb_present() sends per frame, so a big redraw over a
+ * slow link doesn't hold up input echo behind it. Once the budget is spent,
+ * tb_present() stops before the next changed row and leaves it and the rest
+ * for later presents; tb_get_stats() reports how many rows are left. Each
+ * present sends at least one row, so repeated calls converge.
+ *
+ * The cells in the priority rect (see tb_set_priority_rect()) are sent first,
+ * or, if none is set, the rows around the cursor.
+ *
+ * If bytes is 0, frames are sent whole (the default). If bytes is negative,
+ * the function returns the current budget.
+ */
+int tb_set_present_budget(int bytes);
+
+/* Sets the area sent first when a frame is over the present budget. If w or
+ * h is 0, the rows around the cursor are sent first instead.
+ */
+int tb_set_priority_rect(int x, int y, int w, int h);
+
+/* Starts (enable=1) or stops (enable=0) a thread that presents frames in the
+ * background. tb_present() then copies the changed cells for the thread and
+ * returns without waiting for them to be compared and written, so a slow
+ * terminal doesn't hold up the caller. A frame handed off while the thread is
+ * still busy with the previous one waits for it, and is merged with the next
+ * one if that comes first. tb_present() returns errors from earlier frames.
+ *
+ * The cell functions (tb_set_cell(), tb_print(), tb_clear(), etc.) and
+ * tb_present() don't wait for the thread. Other functions that touch the
+ * terminal, such as tb_set_cursor(), tb_send(), tb_get_stats() or handling
+ * a resize event, first wait until the thread has presented every frame
+ * handed to it. Stopping the thread or tb_shutdown() also waits for that.
+ *
+ * If enable is negative, the function returns 1 if the thread is running.
+ * Requires termbox to be compiled with TB_OPT_RENDER_THREAD (and linked with
+ * -pthread), otherwise TB_ERR is returned.
+ */
+int tb_set_render_thread(int enable);
+
+/* Sets how many threads tb_present() uses to compare the back buffer with
+ * the terminal and encode the changes, counting the one calling it. Rows are
+ * split into a band per thread, each thread encoding its rows into output of
+ * its own, which is then joined in order. A row encoded from another cursor
+ * position or attributes than the rows before it leave is encoded again at
+ * the join, usually only the first changed row of each band, so the output
+ * is the same as with 1 thread (the default).
+ *
+ * This is experimental. It's meant for very large screens where much of the
+ * time goes into comparing and encoding rows, but isn't known to be faster
+ * yet; measure with the diff_threads case of tests/bench before relying on
+ * it.
+ *
+ * Rows aren't looked up in the row cache (see tb_set_row_cache()) while more
+ * than 1 thread is used, and with a present budget (see
+ * tb_set_present_budget()) frames are encoded by 1 thread.
+ *
+ * n is capped at TB_DIFF_THREADS_MAX. If n is negative, the function returns
+ * the current number of threads. Requires termbox to be compiled with
+ * TB_OPT_DIFF_THREADS (which implies TB_OPT_RENDER_THREAD), otherwise TB_ERR
+ * is returned.
+ */
+int tb_set_diff_threads(int n);
+
+/* Sets how much memory tb_present() may use to remember the bytes it sent for
+ * rows that changed whole. When a row changes from and to the same content
+ * again, e.g., when switching back and forth between two views, those bytes
+ * are sent instead of encoding the row again. Rows are matched on their old
+ * and new cells and the cursor position and attributes the terminal had
+ * before them, so the output is the same as without the cache. The least
+ * recently used rows are dropped to stay under the limit. tb_get_stats()
+ * reports hits, misses and the memory in use.
+ *
+ * If bytes is 0, the cache is emptied and disabled (the default). If bytes is
+ * negative, the function returns the current limit.
+ */
+int tb_set_row_cache(int bytes);
+
 /* Wait for an event up to timeout_ms milliseconds and fill the event structure
  * with it. If no event is available within the timeout period, TB_ERR_NO_EVENT
  * is returned. On a resize event, the underlying select(2) call may be
@@ -551,7 +881,9 @@ int tb_print_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
 int tb_printf_ex(int x, int y, uintattr_t fg, uintattr_t bg, size_t *out_w,
     const char *fmt, ...);
 
-/* Send raw bytes to terminal. */
+/* Send raw bytes to terminal. The cursor position and attributes termbox
+ * assumes the terminal has are forgotten, so the next cell sent resets them
+ * in full. */
 int tb_send(const char *buf, size_t nbuf);
 int tb_sendf(const char *fmt, ...);
 
@@ -587,6 +919,86 @@ const char *tb_version(void);
 
 #ifdef TB_IMPL
 
+/* Define TB_OPT_NO_SIMD to disable the SSE2/AVX2 kernels used by tb_present().
+ * Otherwise they are selected at runtime based on CPU support.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) &&         \
+    !defined(TB_OPT_NO_SIMD)
+#define TB_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Define TB_OPT_SOA to keep the ch, fg and bg of the cells of each cell buffer
+ * in separate arrays, see struct cellbuf_t. Cells can then be written a row
+ * at a time with tb_cell_row().
+ */
+
+/* Whether tb_cell_buffer() hands out a copy of the back buffer, see
+ * view_load() */
+#if defined(TB_OPT_EGC) || defined(TB_OPT_SOA)
+#define TB_CELL_VIEW
+#endif
+
+/* Front buffer marker for columns covered by the preceding wide cell */
+#define TB_SHADOW_CH 0xffffffff
+
+/* Optional terminal caps (bitwise) (global.opt_caps) */
+#define TB_OPTCAP_CSR  1 /* change_scroll_region */
+#define TB_OPTCAP_INDN 2 /* parm_index */
+#define TB_OPTCAP_RIN  4 /* parm_rindex */
+#define TB_OPTCAP_HPA  8 /* column_address */
+#define TB_OPTCAP_VPA 16 /* row_address */
+#define TB_OPTCAP_CUF 32 /* parm_right_cursor */
+#define TB_OPTCAP_CUB 64 /* parm_left_cursor */
+#define TB_OPTCAP_CUU 128 /* parm_up_cursor */
+#define TB_OPTCAP_CUD 256 /* parm_down_cursor */
+#define TB_OPTCAP_ECH 512 /* erase_chars */
+#define TB_OPTCAP_EL  1024 /* clr_eol */
+#define TB_OPTCAP_REP 2048 /* repeat_char */
+#define TB_OPTCAP_BCE 4096 /* back_color_erase (boolean) */
+#define TB_OPTCAP_ECMA_SGR 8192 /* attribute caps are plain ECMA-48 SGR */
+#define TB_OPTCAP_AM  16384 /* auto_right_margin (boolean) */
+
+/* Rendered attributes (bitwise) (struct sgr_t) */
+#define TB_SGR_BOLD       1
+#define TB_SGR_BLINK      2
+#define TB_SGR_UNDERLINE  4
+#define TB_SGR_ITALIC     8
+#define TB_SGR_REVERSE    16
+#define TB_SGR_FG_DEFAULT 32
+#define TB_SGR_BG_DEFAULT 64
+
+/* Longest parameter list of an SGR sequence built by send_attr() */
+#define TB_SGR_PARAMS_LEN 64
+
+/* Number of attribute changes remembered by send_attr() (power of 2) */
+#define TB_SGR_CACHE_SIZE 256
+
+/* Hash buckets of the row cache (power of 2), see tb_set_row_cache() */
+#define TB_ROW_CACHE_BUCKETS 1024
+
+/* Hash buckets of the grapheme cluster table (power of 2), and how many
+ * clusters no cell holds anymore are kept before freeing them */
+#define TB_CLUSTER_BUCKETS 1024
+#define TB_CLUSTER_UNUSED_MAX 1024
+
+/* Typical lengths of a cursor jump and an attribute change, as estimated by
+ * present_repaint() */
+#define TB_REPAINT_JUMP_COST 6
+#define TB_REPAINT_ATTR_COST 8
+
+/* Most threads tb_set_diff_threads() starts, counting the caller */
+#define TB_DIFF_THREADS_MAX 8
+
+/* Rows above and below the cursor sent first when over the present budget */
+#define TB_BUDGET_CURSOR_ROWS 1
+
+/* Length of the plain-data prefix of a cell (ch, fg, bg) */
+#define TB_CELL_KEY_LEN (offsetof(struct cell_t, bg) + sizeof(uintattr_t))
+
+/* Set in the ch of a cell holding a grapheme cluster, along with its id */
+#define TB_CLUSTER_BIT 0x80000000
+
 #define if_err_return(rv, expr)                                                \
     if (((rv) = (expr)) != TB_OK)                                              \
     return (rv)
@@ -601,11 +1013,11 @@ const char *tb_version(void);
     return (rv)
 
 #define send_literal(rv, a)                                                    \
-    if_err_return((rv), bytebuf_nputs(&global.out, (a), sizeof(a) - 1))
+    if_err_return((rv), bytebuf_nputs(&enc->out, (a), sizeof(a) - 1))
 
 #define send_num(rv, nbuf, n)                                                  \
     if_err_return((rv),                                                        \
-        bytebuf_nputs(&global.out, (nbuf), convert_num((n), (nbuf))))
+        bytebuf_nputs(&enc->out, (nbuf), convert_num((n), (nbuf))))
 
 #define snprintf_or_return(rv, str, sz, fmt, ...)                              \
     do {                                                                       \
@@ -622,14 +1034,214 @@ struct bytebuf_t {
     char *buf;
     size_t len;
     size_t cap;
+    size_t off; /* bytes of buf already written by bytebuf_flush() */
+};
+
+/* A cell as the cell buffers hold it. Without TB_OPT_EGC, it's laid out as
+ * struct tb_cell, so tb_cell_buffer() hands out the back buffer itself. With
+ * it, a cell holding a grapheme cluster has TB_CLUSTER_BIT and the cluster's
+ * id in ch instead, so cells stay plain data as small as without clusters.
+ * tb_cell_buffer() then hands out a copy of the back buffer as struct tb_cell,
+ * see view_load(). With TB_OPT_SOA, cell buffers hold the fields in separate
+ * arrays instead, and this is only the layout of a row cache key. */
+struct cell_t {
+    uint32_t ch;
+    uintattr_t fg;
+    uintattr_t bg;
 };
 
+#ifndef TB_OPT_EGC
+/* Fails to compile if struct cell_t and struct tb_cell are laid out apart */
+typedef char cell_t_is_tb_cell[
+    sizeof(struct cell_t) == sizeof(struct tb_cell) &&
+            offsetof(struct cell_t, ch) == offsetof(struct tb_cell, ch) &&
+            offsetof(struct cell_t, fg) == offsetof(struct tb_cell, fg) &&
+            offsetof(struct cell_t, bg) == offsetof(struct tb_cell, bg)
+        ? 1
+        : -1];
+#endif
+
+struct cellspan_t {
+    int x0;
+    int x1;
+};
+
+/* Cells are addressed by index, y * width + x, and their fields accessed with
+ * cell_ch(), cell_fg() and cell_bg(), so the layout is left to TB_OPT_SOA */
 struct cellbuf_t {
     int width;
     int height;
-    struct tb_cell *cells;
+#ifdef TB_OPT_SOA
+    uint32_t *ch;
+    uintattr_t *fg;
+    uintattr_t *bg;
+#else
+    struct cell_t *cells;
+#endif
+    struct cellspan_t *dirty; /* per-row columns changed since last present,
+                                 in the front buffer since last hashed */
+    uint8_t *widths;          /* per-cell display width, 0 if not cached */
+    uint32_t *hashes;         /* per-row hash, see cellbuf_hash_rows() */
+    int cap;                  /* cells allocated, see cellbuf_resize() */
+    int rows_cap;             /* rows allocated for dirty and hashes */
 };
 
+#ifdef TB_OPT_SOA
+#define cell_ch(c, i) ((c)->ch[i])
+#define cell_fg(c, i) ((c)->fg[i])
+#define cell_bg(c, i) ((c)->bg[i])
+#else
+#define cell_ch(c, i) ((c)->cells[i].ch)
+#define cell_fg(c, i) ((c)->cells[i].fg)
+#define cell_bg(c, i) ((c)->cells[i].bg)
+#endif
+
+/* What the terminal renders for an fg/bg pair in the current output mode */
+struct sgr_t {
+    int attrs;      /* TB_SGR_* */
+    uintattr_t cfg; /* fg color, 0 if TB_SGR_FG_DEFAULT */
+    uintattr_t cbg; /* bg color, 0 if TB_SGR_BG_DEFAULT */
+};
+
+/* An attribute change sent by send_attr(), see sgr_cache_slot() */
+struct sgr_cache_entry_t {
+    int mode; /* output mode, 0 if unused */
+    uintattr_t from_fg;
+    uintattr_t from_bg;
+    uintattr_t fg;
+    uintattr_t bg;
+    struct sgr_t sgr; /* state after sending seq */
+    uint8_t len;
+    char seq[TB_SGR_PARAMS_LEN + 3];
+};
+
+/* What the terminal was left with by the bytes sent so far */
+struct term_state_t {
+    int last_x;
+    int last_y;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+    struct sgr_t last_sgr;
+    int has_last_sgr;
+};
+
+/* Output and the terminal state it leaves, with the stats of the frame. enc
+ * points to global.encoder, except in the diff threads, which each encode
+ * their band of rows into one of their own (see present_bands()). */
+struct encoder_t {
+    struct bytebuf_t out;
+    int last_x; /* -1 if unknown, width if an autowrap is pending */
+    int last_y;
+    uintattr_t last_fg;
+    uintattr_t last_bg;
+    struct sgr_t last_sgr;
+    int has_last_sgr;
+    int erased_x; /* cells send_run() erased in the row being sent, */
+    int erased_y; /* see motion_cells() */
+    int erased_n;
+    struct sgr_cache_entry_t sgr_cache[TB_SGR_CACHE_SIZE];
+    struct tb_stats stats;
+};
+
+/* A row sent whole by present_row(), see present_row_cached() */
+struct row_cache_entry_t {
+    struct row_cache_entry_t *next;  /* in the same bucket */
+    struct row_cache_entry_t *newer; /* in order of use */
+    struct row_cache_entry_t *older;
+    size_t size; /* allocated, including what follows */
+    uint32_t hash;
+    int y;
+    int width;
+    struct term_state_t from; /* before the row was sent */
+    struct term_state_t to;   /* after it was sent */
+    size_t cells;
+    size_t cursor_moves;
+    size_t cursor_bytes;
+    size_t len; /* bytes sent */
+    /* The first TB_CELL_KEY_LEN bytes of each back cell, then of each front
+     * cell, then the bytes sent */
+    char data[];
+};
+
+struct row_cache_t {
+    struct row_cache_entry_t *buckets[TB_ROW_CACHE_BUCKETS];
+    struct row_cache_entry_t *newest;
+    struct row_cache_entry_t *oldest;
+    size_t size;
+    size_t max_size; /* 0 if disabled */
+};
+
+#ifdef TB_OPT_EGC
+/* A grapheme cluster shared by the cells holding it, see cluster_get() */
+struct cluster_t {
+    struct cluster_t *next; /* in the same bucket */
+    uint32_t hash;
+    uint32_t id;
+    size_t refs; /* cells holding it */
+    size_t nch;
+    uint32_t ch[]; /* nch code points, then 0 */
+};
+
+struct cluster_table_t {
+    struct cluster_t *buckets[TB_CLUSTER_BUCKETS];
+    size_t nused;
+    size_t nunused; /* kept in case a cell takes them again */
+    struct cluster_t **ids; /* by id, NULL if free */
+    uint32_t *free_ids;
+    size_t nids; /* ids handed out, including free ones */
+    size_t nfree;
+    size_t cids; /* capacity of ids and free_ids */
+#ifdef TB_OPT_RENDER_THREAD
+    pthread_mutex_t lock; /* used while the render thread runs */
+#endif
+};
+#endif
+
+#ifdef TB_OPT_RENDER_THREAD
+struct render_thread_t {
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards next and the flags below */
+    pthread_cond_t cond;  /* signaled when a flag changes */
+    struct cellbuf_t next;  /* changes handed off by tb_present() */
+    struct cellbuf_t cells; /* copy of the back buffer the thread presents */
+    int running;
+    int has_frame; /* next holds changes the thread hasn't taken */
+    int busy;      /* the thread is presenting cells */
+    int quit;
+    int rv; /* first error from a frame, reported by tb_present() */
+};
+#endif
+
+#ifdef TB_OPT_DIFF_THREADS
+/* A row a diff thread encoded, see present_bands() */
+struct band_row_t {
+    struct term_state_t from; /* state the row was encoded from */
+    struct term_state_t to;
+    size_t off; /* where the row starts in the thread's output */
+    size_t len; /* 0 if the row didn't change */
+    size_t cells;
+    size_t cursor_moves;
+    size_t cursor_bytes;
+    size_t sgr_cache_hits;
+    size_t sgr_cache_misses;
+};
+
+struct diff_pool_t {
+    pthread_t threads[TB_DIFF_THREADS_MAX - 1];
+    int ids[TB_DIFF_THREADS_MAX - 1]; /* band - 1 of each thread */
+    int rv[TB_DIFF_THREADS_MAX - 1];  /* from encoding each band */
+    struct encoder_t *encoders;       /* one per thread, NULL if stopped */
+    struct band_row_t *rows;          /* rows of the frame, by y */
+    int nrows;
+    int nthreads;         /* threads besides the one presenting */
+    pthread_mutex_t lock; /* guards the fields below */
+    pthread_cond_t cond;  /* signaled when a field changes */
+    int gen;              /* incremented for each frame to compare */
+    int busy;             /* threads still comparing rows of the frame */
+    int quit;
+};
+#endif
+
 struct cap_trie_t {
     char c;
     struct cap_trie_t *children;
@@ -649,33 +1261,78 @@ struct tb_global_t {
     int height;
     int cursor_x;
     int cursor_y;
-    int last_x;
-    int last_y;
     uintattr_t fg;
     uintattr_t bg;
-    uintattr_t last_fg;
-    uintattr_t last_bg;
+    struct encoder_t encoder;
+    struct row_cache_t row_cache;
     int input_mode;
     int output_mode;
+    int present_mode;
+    int present_swap; /* present_diff() swaps buffers instead of copying */
+    int present_banded; /* present_bands() updates the front rows afterwards */
+    int sync_mode;
+    int flush_mode;
+    int wfd_flags; /* fcntl() flags of wfd to restore, or -1 if untouched */
+    int max_fps;
+    size_t present_budget;
+    int priority_x;
+    int priority_y;
+    int priority_w;
+    int priority_h;
+    int frame_pending;   /* tb_present() held back a frame */
+    int64_t frame_time;  /* monotonic time the last frame was sent, in us */
+    size_t frames_merged;
+    size_t frames_dropped;
+    int has_sync;  /* terminal reported support for mode 2026 */
+    int sync_query; /* the mode 2026 query is still awaiting its reply */
+    int nreplies;  /* replies to queries consumed by extract_event() */
+    int opt_caps;
     char *terminfo;
     size_t nterminfo;
     const char *caps[TB_CAP__COUNT];
     struct cap_trie_t cap_trie;
     struct bytebuf_t in;
-    struct bytebuf_t out;
     struct cellbuf_t back;
     struct cellbuf_t front;
+    struct cellbuf_t *draw; /* cells tb_present() sends, &back or a copy */
+#ifdef TB_OPT_EGC
+    struct cluster_table_t clusters;
+#endif
+#ifdef TB_CELL_VIEW
+    struct tb_cell *view; /* see tb_cell_buffer(), NULL if unused */
+    int view_out; /* view may hold writes view_store() hasn't taken in */
+#endif
+#ifdef TB_OPT_SOA
+    uint8_t *rows_out; /* rows handed out by tb_cell_row(), NULL if none yet */
+    int nrows_out;
+#ifdef TB_OPT_EGC
+    uint32_t *rows_ch; /* ch of the back buffer as of then, see rows_store() */
+#endif
+#endif
+#ifdef TB_OPT_RENDER_THREAD
+    struct render_thread_t render;
+#endif
+#ifdef TB_OPT_DIFF_THREADS
+    struct diff_pool_t diff_pool;
+#endif
     struct termios orig_tios;
     int has_orig_tios;
     int last_errno;
     int initialized;
     int (*fn_extract_esc_pre)(struct tb_event *, size_t *);
     int (*fn_extract_esc_post)(struct tb_event *, size_t *);
+    size_t (*mem_diff)(const void *, const void *, size_t);
     char errbuf[1024];
 };
 
 static struct tb_global_t global = {0};
 
+#ifdef TB_OPT_DIFF_THREADS
+static __thread struct encoder_t *enc = &global.encoder;
+#else
+static struct encoder_t *enc = &global.encoder;
+#endif
+
 /* BEGIN codegen c */
 /* Produced by ./codegen.sh on Sun, 19 Sep 2021 01:02:03 +0000 */
 
@@ -1346,6 +2003,30 @@ static struct {
     {NULL,           0,                  0                                      },
 };
 
+/* Optional caps, probed by terminfo string index. Their sequences are not
+ * read from terminfo but hard-coded like TB_HARDCAP_*, so only presence is
+ * checked. Built-in terms get TB_OPTCAP_BUILTIN. */
+#define TB_OPTCAP_BUILTIN                                                      \
+    (TB_OPTCAP_CSR | TB_OPTCAP_CUF | TB_OPTCAP_CUB | TB_OPTCAP_CUU |           \
+        TB_OPTCAP_CUD | TB_OPTCAP_EL | TB_OPTCAP_AM)
+static const struct {
+    int16_t index;
+    int flag;
+} terminfo_opt_caps[] = {
+    {3,   TB_OPTCAP_CSR},
+    {109, TB_OPTCAP_INDN},
+    {113, TB_OPTCAP_RIN},
+    {8,   TB_OPTCAP_HPA},
+    {127, TB_OPTCAP_VPA},
+    {112, TB_OPTCAP_CUF},
+    {111, TB_OPTCAP_CUB},
+    {114, TB_OPTCAP_CUU},
+    {107, TB_OPTCAP_CUD},
+    {37,  TB_OPTCAP_ECH},
+    {6,   TB_OPTCAP_EL},
+    {121, TB_OPTCAP_REP},
+};
+
 static const unsigned char utf8_length[256] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
     1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
@@ -1382,38 +2063,148 @@ static int load_terminfo_from_path(const char *path, const char *term);
 static int read_terminfo_path(const char *path);
 static int parse_terminfo_caps(void);
 static int load_builtin_caps(void);
+static int probe_terminfo_opt_caps(int16_t str_offsets_pos,
+    int16_t str_table_len, int16_t nstrs);
 static const char *get_terminfo_string(int16_t str_offsets_pos,
     int16_t str_table_pos, int16_t str_table_len, int16_t str_index);
 static int wait_event(struct tb_event *event, int timeout);
 static int extract_event(struct tb_event *event);
 static int extract_esc(struct tb_event *event);
+static int extract_esc_reply(void);
 static int extract_esc_user(struct tb_event *event, int is_post);
 static int extract_esc_cap(struct tb_event *event);
 static int extract_esc_mouse(struct tb_event *event);
 static int resize_cellbufs(void);
 static void handle_resize(int sig);
+static int present_frame(void);
+static int present_diff(int x, int y, int w, int h);
+static int present_encode(int x, int y, int w, int h);
+static int present_estimate(struct tb_present_cost *cost);
+static int present_rows(size_t frame_start);
+static int present_rows_region(int x0, int y0, int x1, int y1);
+static int present_row(int y, int x0, int x1);
+static int present_row_cached(int y, int x0, int x1);
+static int present_row_commit(int y);
+static int present_swap(void);
+static int present_rows_budget(size_t frame_start);
+static void render_wait(void);
+#ifdef TB_OPT_RENDER_THREAD
+static int render_start(void);
+static int render_stop(void);
+static int render_submit(void);
+static void *render_main(void *arg);
+#endif
+#ifdef TB_OPT_DIFF_THREADS
+static int diff_pool_start(int nthreads);
+static int diff_pool_stop(void);
+static void *diff_pool_main(void *arg);
+static int present_bands(void);
+static int present_band(int y0, int y1);
+#endif
+static int present_scroll(void);
+static int present_repaint(void);
+static int present_held(void);
+static int64_t present_due_us(void);
+static int64_t monotonic_us(void);
 static int send_attr(uintattr_t fg, uintattr_t bg);
 static int send_sgr(uintattr_t fg, uintattr_t bg, uintattr_t fg_is_default,
     uintattr_t bg_is_default);
+static int send_sgr_delta(struct sgr_t *from, struct sgr_t *to);
+static struct sgr_cache_entry_t *sgr_cache_slot(uintattr_t from_fg,
+    uintattr_t from_bg, uintattr_t fg, uintattr_t bg);
+static int sgr_color_param(char *buf, uintattr_t c, int is_bg);
+static void term_state_save(struct term_state_t *s);
+static void term_state_restore(struct term_state_t *s);
+static int term_state_eq(struct term_state_t *a, struct term_state_t *b);
+static struct row_cache_entry_t *row_cache_find(uint32_t hash, int y,
+    struct term_state_t *from);
+static void row_cache_add(struct row_cache_entry_t *e);
+static void row_cache_link(struct row_cache_entry_t *e);
+static void row_cache_unlink(struct row_cache_entry_t *e);
+static void row_cache_trim(size_t max_size);
+static void sgr_append(char *buf, int *len, const char *param, int nparam);
+static int caps_are_ecma_sgr(void);
 static int send_cursor_if(int x, int y);
-static int send_char(int x, int y, uint32_t ch);
-static int send_cluster(int x, int y, uint32_t *ch, size_t nch);
+static int send_motion(int x, int y);
+static struct cellbuf_t *motion_cells(int x, int y);
+static int send_cup(int x, int y);
+static int send_csi_num(int n, char final);
+static int motion_num_cost(int n);
+static int motion_hcost(int c, int x, int y, int limit, int *kind);
+static int send_scroll(int top, int bot, int n);
+static int send_run(int x, int y, int x1, int *nrun);
+static int send_char(int x, int y, uint32_t ch, int w);
+static int send_cluster(int x, int y, uint32_t *ch, size_t nch, int w);
 static int convert_num(uint32_t num, char *buf);
-static int cell_cmp(struct tb_cell *a, struct tb_cell *b);
-static int cell_copy(struct tb_cell *dst, struct tb_cell *src);
-static int cell_set(struct tb_cell *cell, uint32_t *ch, size_t nch,
+static int cell_width(struct cellbuf_t *c, int i);
+static int cell_cmp(struct cellbuf_t *a, int ai, struct cellbuf_t *b, int bi);
+static int cell_is_erasable(struct cellbuf_t *c, int i);
+static int cell_is_blank(struct cellbuf_t *c, int i, int default_bg);
+static int cell_run_cmp(struct cellbuf_t *a, int ai, struct cellbuf_t *b,
+    int bi, int n);
+static size_t mem_diff_scalar(const void *a, const void *b, size_t n);
+#ifdef TB_SIMD_X86
+static size_t mem_diff_sse2(const void *a, const void *b, size_t n);
+static size_t mem_diff_avx2(const void *a, const void *b, size_t n);
+#endif
+static int cell_copy(struct cellbuf_t *dst, int di, struct cellbuf_t *src,
+    int si);
+static int cell_set(struct cellbuf_t *c, int i, uint32_t *ch, size_t nch,
     uintattr_t fg, uintattr_t bg);
-static int cell_reserve_ech(struct tb_cell *cell, size_t n);
-static int cell_free(struct tb_cell *cell);
+static int cell_free(struct cellbuf_t *c, int i);
+#ifdef TB_OPT_EGC
+static int cluster_get(uint32_t *ch, size_t nch, uint32_t *out);
+static struct cluster_t *cluster_find(uint32_t ch);
+static void cluster_hold(uint32_t ch);
+static void cluster_drop(uint32_t ch);
+static void cluster_sweep(int all);
+static void cluster_lock(void);
+static void cluster_unlock(void);
+static int cell_has_cluster(struct cellbuf_t *c, int i);
+#endif
+static void view_load(int i, int n);
+static int view_store(void);
+#ifdef TB_CELL_VIEW
+static int view_store_cell(int i);
+#endif
+static void view_free(void);
+#ifdef TB_OPT_SOA
+static int rows_store(void);
+#endif
 static int cellbuf_init(struct cellbuf_t *c, int w, int h);
 static int cellbuf_free(struct cellbuf_t *c);
 static int cellbuf_clear(struct cellbuf_t *c);
-static int cellbuf_get(struct cellbuf_t *c, int x, int y, struct tb_cell **out);
+static void cellbuf_fill(struct cellbuf_t *c, int i, int n, uintattr_t fg,
+    uintattr_t bg);
+static void cellbuf_blank(struct cellbuf_t *c, int i, int n, uintattr_t fg,
+    uintattr_t bg);
+static void cellbuf_drop(struct cellbuf_t *c, int i, int n);
+static void cellbuf_move(struct cellbuf_t *c, int dst, int src, int n);
+static int cellbuf_get(struct cellbuf_t *c, int x, int y, int *out);
+static int cellbuf_set(struct cellbuf_t *c, int x, int y, uint32_t *ch,
+    size_t nch, uintattr_t fg, uintattr_t bg, int w);
 static int cellbuf_resize(struct cellbuf_t *c, int w, int h);
+static int cellbuf_realloc(struct cellbuf_t *c, int cap, int rows_cap);
+static int cellbuf_dirty(struct cellbuf_t *c, int x0, int y0, int x1, int y1);
+static int cellbuf_dirty_all(struct cellbuf_t *c);
+#ifdef TB_OPT_RENDER_THREAD
+static int cellbuf_copy_dirty(struct cellbuf_t *dst, struct cellbuf_t *src);
+#endif
+static int cellbuf_hash_rows(struct cellbuf_t *c, int y0, int y1);
+static int cellbuf_row_eq(struct cellbuf_t *a, int ay, struct cellbuf_t *b,
+    int by);
+static int cellbuf_row_uniform(struct cellbuf_t *c, int y);
+static void cellbuf_row_key(struct cellbuf_t *c, int y, char *key);
+static int cellbuf_row_key_eq(struct cellbuf_t *c, int y, const char *key);
+static void cellbuf_swap_cells(struct cellbuf_t *a, struct cellbuf_t *b);
+static int cellbuf_reverse_rows(struct cellbuf_t *c, int y0, int y1);
+static int cellbuf_scroll(struct cellbuf_t *c, int top, int bot, int n,
+    uintattr_t fg, uintattr_t bg);
 static int bytebuf_puts(struct bytebuf_t *b, const char *str);
 static int bytebuf_nputs(struct bytebuf_t *b, const char *str, size_t nstr);
 static int bytebuf_shift(struct bytebuf_t *b, size_t n);
 static int bytebuf_flush(struct bytebuf_t *b, int fd);
+static int bytebuf_flush_nonblock(struct bytebuf_t *b, int fd);
 static int bytebuf_reserve(struct bytebuf_t *b, size_t sz);
 static int bytebuf_free(struct bytebuf_t *b);
 
@@ -0,0 +1,927 @@
+/*
+	Microbenchmarks for termbox internals.
+
+	Build with `./build.sh bench`, then run `./tests/bench [case] [w] [h]`.
+	Output goes to a pseudo-terminal drained by a child process, so the
+	numbers measure termbox itself rather than a terminal emulator.
+*/
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#define TB_IMPL
+#define TB_OPT_RENDER_THREAD
+#define TB_OPT_DIFF_THREADS
+
+#include <stdlib.h>
+
+/* Count the allocations termbox makes */
+static size_t bench_allocs;
+
+static void *bench_malloc(size_t n) {
+    bench_allocs++;
+    return malloc(n);
+}
+
+static void *bench_realloc(void *p, size_t n) {
+    bench_allocs++;
+    return realloc(p, n);
+}
+
+#define tb_malloc  bench_malloc
+#define tb_realloc bench_realloc
+#define tb_free    free
+
+#include "../termbox-static.h"
+
+#include <locale.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+
+static int bench_w = 300;
+static int bench_h = 90;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int open_pty(pid_t *drain_pid) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        return -1;
+    }
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        return -1;
+    }
+    struct winsize ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.ws_col = bench_w;
+    ws.ws_row = bench_h;
+    ioctl(slave, TIOCSWINSZ, &ws);
+
+    // Drain the terminal side so writes never block
+    *drain_pid = fork();
+    if (*drain_pid == 0) {
+        char buf[65536];
+        close(slave);
+        while (read(master, buf, sizeof(buf)) > 0)
+            ;
+        _exit(0);
+    }
+    close(master);
+    return slave;
+}
+
+static void fill_screen(void) {
+    int x, y;
+    for (y = 0; y < bench_h; y++) {
+        for (x = 0; x < bench_w; x++) {
+            tb_set_cell(x, y, 'a' + (x * y) % 26, 1 + x % 8, 1 + y % 8);
+        }
+    }
+}
+
+/* A full-screen frame identical to the previous one, so every cell is
+ * compared and nothing is sent. */
+static void bench_present_unchanged(int n) {
+    struct {
+        const char *name;
+        size_t (*fn)(const void *, const void *, size_t);
+        int supported;
+    } kernels[] = {
+        {"scalar", mem_diff_scalar, 1},
+#ifdef TB_SIMD_X86
+        {"sse2",   mem_diff_sse2,   __builtin_cpu_supports("sse2")},
+        {"avx2",   mem_diff_avx2,   __builtin_cpu_supports("avx2")},
+#endif
+    };
+    size_t k;
+    int i;
+
+    fill_screen();
+    tb_present();
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (!kernels[k].supported) {
+            continue;
+        }
+        global.mem_diff = kernels[k].fn;
+        double start = now_ns();
+        for (i = 0; i < n; i++) {
+            tb_invalidate();
+            tb_present();
+        }
+        printf("present_unchanged %dx%d %-6s %10.0f ns/frame\n", bench_w,
+            bench_h, kernels[k].name, (now_ns() - start) / n);
+    }
+}
+
+/* A scripted editor-like session: sparse edits scattered over the screen, a
+ * line being typed, and a status line. Reports bytes written per frame. */
+static void bench_motion(int n) {
+    struct tb_stats stats;
+    size_t bytes = 0, cursor_bytes = 0;
+    unsigned seed = 1;
+    int i, k;
+
+    fill_screen();
+    tb_present();
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < 8; k++) {
+            seed = seed * 1103515245 + 12345;
+            int x = (seed >> 8) % bench_w;
+            int y = (seed >> 20) % bench_h;
+            tb_set_cell(x, y, 'A' + i % 26, 1 + x % 8, 1 + y % 8);
+        }
+        tb_set_cell(i % bench_w, bench_h / 2, 'a' + i % 26, 0, 0);
+        tb_printf(0, bench_h - 1, 0, 0, "frame %d", i);
+        tb_set_cursor(i % bench_w + 1, bench_h / 2);
+        tb_present();
+        tb_get_stats(&stats);
+        bytes += stats.bytes;
+        cursor_bytes += stats.cursor_bytes;
+    }
+    printf("motion %dx%d %8.1f bytes/frame %8.1f cursor bytes/frame\n",
+        bench_w, bench_h, (double)bytes / n, (double)cursor_bytes / n);
+}
+
+/* A bordered layout alternating between a filled list pane and an empty one
+ * with a moving separator, so most rows are redrawn as rules and blank runs.
+ * Reports bytes written per frame. */
+static void bench_layout(int n) {
+    struct tb_stats stats;
+    size_t bytes = 0;
+    int i, x, y;
+
+    for (i = 0; i < n; i++) {
+        int sep = i % 2 ? bench_h / 3 : bench_h * 2 / 3;
+        tb_clear();
+        for (x = 0; x < bench_w; x++) {
+            tb_set_cell(x, 0, 0x2500, 0, 0);
+            tb_set_cell(x, sep, 0x2500, 0, 0);
+            tb_set_cell(x, bench_h - 1, 0x2500, 0, 0);
+        }
+        for (y = 1; y < bench_h - 1; y++) {
+            tb_set_cell(0, y, 0x2502, 0, 0);
+            tb_set_cell(bench_w - 1, y, 0x2502, 0, 0);
+            if (i % 2 == 0 && y != sep) {
+                tb_printf(2, y, 0, 0, "item %d", y + i);
+                for (x = 12; x < 12 + (y * 7) % (bench_w - 14); x++) {
+                    tb_set_cell(x, y, '.', 0, 0);
+                }
+            }
+        }
+        tb_present();
+        tb_get_stats(&stats);
+        bytes += stats.bytes;
+    }
+    printf("layout %dx%d %8.1f bytes/frame\n", bench_w, bench_h,
+        (double)bytes / n);
+}
+
+/* Rows of short cells whose colors and attributes change every few columns,
+ * like syntax-highlighted text. Reports bytes written per frame. */
+static void bench_styled(int n) {
+    static const uintattr_t attrs[] = {0, TB_BOLD, TB_UNDERLINE, TB_BOLD};
+    struct tb_stats stats;
+    size_t bytes = 0, hits = 0, misses = 0;
+    double ns = 0;
+    int i, x, y;
+
+    for (i = 0; i < n; i++) {
+        for (y = 0; y < bench_h; y++) {
+            for (x = 0; x < bench_w; x++) {
+                int span = (x + y + i) / 4;
+                tb_set_cell(x, y, 'a' + (x + i) % 26,
+                    (1 + span % 7) | attrs[span % 4], span % 3 ? 0 : 5);
+            }
+        }
+        double start = now_ns();
+        tb_present();
+        ns += now_ns() - start;
+        tb_get_stats(&stats);
+        bytes += stats.bytes;
+        hits += stats.sgr_cache_hits;
+        misses += stats.sgr_cache_misses;
+    }
+    printf("styled %dx%d %8.1f bytes/frame %10.0f ns/frame sgr cache %zu/%zu "
+           "hits\n",
+        bench_w, bench_h, (double)bytes / n, ns / n, hits, hits + misses);
+}
+
+/* Alternates between two full pages of text with ragged line ends, like
+ * paging through a document, once updating changed cells and once with
+ * TB_PRESENT_REPAINT. Reports bytes written per frame. */
+static void bench_flip(int n) {
+    static const int modes[] = {TB_PRESENT_NORMAL, TB_PRESENT_REPAINT};
+    struct tb_stats stats;
+    size_t m;
+    int i, x, y;
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        size_t bytes = 0;
+        int repainted = 0;
+        tb_set_present_mode(modes[m]);
+        for (i = 0; i < n; i++) {
+            tb_clear();
+            for (y = 0; y < bench_h; y++) {
+                int len = (y * 37 + i * 11) % bench_w;
+                for (x = 0; x < len; x++) {
+                    tb_set_cell(x, y, 'a' + (x + y + i) % 26, 0, 0);
+                }
+            }
+            tb_present();
+            tb_get_stats(&stats);
+            bytes += stats.bytes;
+            repainted += stats.repainted;
+        }
+        printf("flip %dx%d %-7s %8.1f bytes/frame %d/%d repainted\n",
+            bench_w, bench_h, m ? "repaint" : "normal", (double)bytes / n,
+            repainted, n);
+    }
+}
+
+/* Reads what is in the pipe into buf, which holds cap bytes and has len
+ * filled. Bytes past cap are read and dropped so the writer never blocks. */
+static void drain_pipe(int fd, char *buf, size_t cap, size_t *len) {
+    char sink[65536];
+    ssize_t nread;
+    for (;;) {
+        size_t room = cap - *len;
+        if (room > sizeof(sink)) {
+            room = sizeof(sink);
+        }
+        nread = room > 0 ? read(fd, buf + *len, room)
+                         : read(fd, sink, sizeof(sink));
+        if (nread <= 0) {
+            break;
+        } else if (room > 0) {
+            *len += (size_t)nread;
+        }
+    }
+}
+
+/* Captures a styled frame, splits it into escape sequences and text runs as
+ * an iovec-based output path would reference them, and compares copying the
+ * pieces into one buffer for write() with handing them to writev(). */
+static void bench_flush(int n) {
+    static const uintattr_t attrs[] = {0, TB_BOLD, TB_UNDERLINE, TB_BOLD};
+    int pipefd[2], tty = global.wfd;
+    int i, k, x, y;
+
+    if (pipe(pipefd) != 0) {
+        return;
+    }
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    for (y = 0; y < bench_h; y++) {
+        for (x = 0; x < bench_w; x++) {
+            int span = (x + y) / 4;
+            tb_set_cell(x, y, 'a' + x % 26,
+                (1 + span % 7) | attrs[span % 4], span % 3 ? 0 : 5);
+        }
+    }
+
+    // Read the frame back while presenting so the pipe never fills up
+    size_t cap = (size_t)bench_w * bench_h * 32;
+    char *frame = malloc(cap);
+    size_t len = 0;
+    global.wfd = pipefd[1];
+    fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+    tb_set_flush_mode(TB_FLUSH_APPEND);
+    while (tb_present() == TB_ERR_WOULD_BLOCK || global.encoder.out.len > 0) {
+        drain_pipe(pipefd[0], frame, cap, &len);
+        tb_flush();
+    }
+    drain_pipe(pipefd[0], frame, cap, &len);
+    tb_set_flush_mode(TB_FLUSH_BLOCKING);
+    global.wfd = tty;
+
+    // Escape sequences end at their final byte, text at the next escape
+    struct iovec *iov = malloc(len * sizeof(*iov));
+    size_t start, end;
+    int niov = 0;
+    for (start = 0; start < len; start = end) {
+        end = start + 1;
+        if (frame[start] != '\x1b') {
+            while (end < len && frame[end] != '\x1b') {
+                end++;
+            }
+        } else if (end < len && frame[end] == '[') {
+            while (++end < len && (frame[end] < '@' || frame[end] > '~'))
+                ;
+            end++;
+        } else {
+            while (end < len && frame[end] >= ' ' && frame[end] <= '/') {
+                end++;
+            }
+            end++;
+        }
+        if (end > len) {
+            end = len;
+        }
+        iov[niov].iov_base = frame + start;
+        iov[niov].iov_len = end - start;
+        niov++;
+    }
+
+    char *copy = malloc(len);
+    double start_ns = now_ns();
+    for (k = 0; k < n; k++) {
+        size_t off = 0;
+        for (i = 0; i < niov; i++) {
+            memcpy(copy + off, iov[i].iov_base, iov[i].iov_len);
+            off += iov[i].iov_len;
+        }
+        if (write(tty, copy, off) < 0) {
+            break;
+        }
+    }
+    double copy_ns = (now_ns() - start_ns) / n;
+
+    start_ns = now_ns();
+    for (k = 0; k < n; k++) {
+        for (i = 0; i < niov; i += IOV_MAX) {
+            if (writev(tty, iov + i, niov - i < IOV_MAX ? niov - i : IOV_MAX) <
+                0)
+            {
+                break;
+            }
+        }
+    }
+    double writev_ns = (now_ns() - start_ns) / n;
+
+    printf("flush %dx%d %zu bytes %d pieces: copy+write %10.0f ns/frame, "
+           "writev %10.0f ns/frame\n",
+        bench_w, bench_h, len, niov, copy_ns, writev_ns);
+    free(copy);
+    free(iov);
+    free(frame);
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+/* Updates a status line and a scrolling log and presents every millisecond,
+ * like a program echoing fast input, once unpaced and once limited to 60
+ * frames per second. Reports frames sent and bytes written per second. */
+static void bench_paced(int n) {
+    static const int fps[] = {0, 60};
+    struct tb_event event;
+    struct tb_stats stats;
+    size_t m;
+    int i, y;
+
+    for (m = 0; m < sizeof(fps) / sizeof(fps[0]); m++) {
+        size_t bytes = 0, sent = 0;
+        tb_set_max_fps(fps[m]);
+        double start = now_ns();
+        for (i = 0; i < n; i++) {
+            for (y = 0; y < bench_h - 1; y++) {
+                tb_printf(0, y, 0, 0, "%-*d", bench_w, i + y);
+            }
+            tb_printf(0, bench_h - 1, TB_REVERSE, 0, "line %d", i);
+            tb_present();
+            tb_get_stats(&stats);
+            if (!stats.deferred) {
+                bytes += stats.bytes;
+                sent++;
+            }
+
+            // Sends a held-back frame when it's due
+            int due = tb_frame_due_ms();
+            tb_peek_event(&event, 1);
+            if (due >= 0 && tb_frame_due_ms() < 0) {
+                tb_get_stats(&stats);
+                bytes += stats.bytes;
+                sent++;
+            }
+        }
+        double secs = (now_ns() - start) / 1e9;
+        tb_get_stats(&stats);
+        printf("paced %dx%d max_fps=%-2d %6.1f frames/s %10.0f bytes/s "
+               "merged=%zu dropped=%zu\n",
+            bench_w, bench_h, fps[m], sent / secs, bytes / secs,
+            stats.frames_merged, stats.frames_dropped);
+    }
+}
+
+/* A full-screen styled redraw together with one typed character on the
+ * cursor row, once sent whole and once with a present budget. Reports the
+ * bytes of the present that shows the character and how many presents the
+ * redraw takes to converge. */
+static void bench_budget(int n) {
+    static const int budgets[] = {0, 2048};
+    struct tb_stats stats;
+    size_t m;
+    int i, x, y;
+
+    for (m = 0; m < sizeof(budgets) / sizeof(budgets[0]); m++) {
+        size_t echo_bytes = 0;
+        int presents = 0;
+        tb_set_present_budget(budgets[m]);
+        for (i = 0; i < n; i++) {
+            for (y = 0; y < bench_h - 1; y++) {
+                for (x = 0; x < bench_w; x++) {
+                    int span = (x + y + i) / 4;
+                    tb_set_cell(x, y, 'a' + (x + i) % 26, 1 + span % 7, 0);
+                }
+            }
+            tb_set_cell(i % bench_w, bench_h - 1, 'a' + i % 26, 0, 0);
+            tb_set_cursor(i % bench_w + 1, bench_h - 1);
+
+            tb_present();
+            tb_get_stats(&stats);
+            echo_bytes += stats.bytes;
+            presents++;
+            while (stats.rows_left > 0) {
+                tb_present();
+                tb_get_stats(&stats);
+                presents++;
+            }
+        }
+        printf("budget %dx%d budget=%-4d %8.1f bytes with echo %5.1f "
+               "presents/frame\n",
+            bench_w, bench_h, budgets[m], (double)echo_bytes / n,
+            (double)presents / n);
+    }
+    tb_set_present_budget(0);
+    tb_hide_cursor();
+}
+
+/* Scenes presented with 1, 2, 4 and 8 threads: a wall of panels redrawn in
+ * full every frame with a counter changing in each panel, styled text
+ * shifting sideways so that every cell changes, and a gap blanked and filled
+ * in every other row next to a counter. The last one runs without CUF, HPA
+ * and REP, so from 100 rows and columns on (say 400x120) the cursor gets past
+ * the erased gap by re-printing it. Output goes to a pipe read back after
+ * each frame. Reports time per frame and checks that every thread count
+ * sends the same bytes. */
+static void bench_diff_threads(int n) {
+    static const int nthreads[] = {1, 2, 4, 8};
+    static const uintattr_t attrs[] = {0, TB_BOLD, TB_UNDERLINE, TB_BOLD};
+    static const char *scenes[] = {"panels", "styled", "erased"};
+    int pipefd[2], tty = global.wfd, caps = global.opt_caps;
+    size_t m, k, cap = (size_t)bench_w * bench_h * 32;
+    int scene, i, x, y, rv;
+
+    char *frame = malloc(cap);
+    if (!frame || pipe(pipefd) != 0) {
+        free(frame);
+        return;
+    }
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+    global.wfd = pipefd[1];
+    tb_set_flush_mode(TB_FLUSH_APPEND);
+
+    for (scene = 0; scene < 3; scene++) {
+        uint32_t first_hash = 0;
+        if (scene == 2) {
+            global.opt_caps &= ~(TB_OPTCAP_CUF | TB_OPTCAP_HPA | TB_OPTCAP_REP);
+        }
+        for (m = 0; m < sizeof(nthreads) / sizeof(nthreads[0]); m++) {
+            uint32_t hash = 2166136261u;
+            size_t bytes = 0, len;
+            double ns = 0;
+            tb_set_diff_threads(nthreads[m]);
+            tb_clear();
+            len = 0;
+            for (rv = tb_present(); rv == TB_ERR_WOULD_BLOCK ||
+                                    global.encoder.out.len > 0;
+                 rv = tb_flush())
+            {
+                drain_pipe(pipefd[0], frame, cap, &len);
+            }
+            drain_pipe(pipefd[0], frame, cap, &len);
+            for (i = 0; i < n; i++) {
+                for (y = 0; y < bench_h; y++) {
+                    for (x = 0; x < bench_w; x++) {
+                        int span = (x + y + i) / 4;
+                        if (scene == 0) {
+                            tb_set_cell(x, y,
+                                x % 40 == 0 || y % 10 == 0 ? '|' : '.',
+                                1 + (x / 40) % 7, 0);
+                        } else if (scene == 1) {
+                            tb_set_cell(x, y, 'a' + (x + i) % 26,
+                                (1 + span % 7) | attrs[span % 4],
+                                span % 3 ? 0 : 5);
+                        } else {
+                            int gap = x - (bench_w - 20);
+                            tb_set_cell(x, y,
+                                gap >= 0 && gap < 9 && (i + y) % 2 ? ' '
+                                : gap == 9                      ? '0' + i % 10
+                                                                : 'a' + x % 26,
+                                0, 0);
+                        }
+                    }
+                }
+                for (y = 1; scene == 0 && y < bench_h; y += 10) {
+                    for (x = 1; x < bench_w; x += 40) {
+                        tb_printf(x, y, TB_BOLD, 0, "%6d", i * (x + y));
+                    }
+                }
+                double start = now_ns();
+                rv = tb_present();
+                ns += now_ns() - start;
+
+                len = 0;
+                for (; rv == TB_ERR_WOULD_BLOCK || global.encoder.out.len > 0;
+                     rv = tb_flush())
+                {
+                    drain_pipe(pipefd[0], frame, cap, &len);
+                }
+                drain_pipe(pipefd[0], frame, cap, &len);
+                for (k = 0; k < len; k++) {
+                    hash = (hash ^ (uint8_t)frame[k]) * 16777619u;
+                }
+                bytes += len;
+            }
+            if (m == 0) {
+                first_hash = hash;
+            }
+            printf("diff_threads %dx%d %s threads=%d %10.0f ns/frame %8.1f "
+                   "bytes/frame%s\n",
+                bench_w, bench_h, scenes[scene], nthreads[m], ns / n,
+                (double)bytes / n, hash == first_hash ? "" : " MISMATCH");
+        }
+    }
+    tb_set_diff_threads(1);
+    tb_set_flush_mode(TB_FLUSH_BLOCKING);
+    global.opt_caps = caps;
+    global.wfd = tty;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    free(frame);
+}
+
+/* Styled full-screen frames presented back to back, once on the caller's
+ * thread and once handed off to the render thread. Reports how long
+ * tb_present() takes the caller and the total including the last frame. */
+static void bench_thread(int n) {
+    static const uintattr_t attrs[] = {0, TB_BOLD, TB_UNDERLINE, TB_BOLD};
+    struct tb_stats stats;
+    int t, i, x, y;
+
+    for (t = 0; t <= 1; t++) {
+        double caller_ns = 0;
+        size_t merged;
+        tb_get_stats(&stats);
+        merged = stats.frames_merged;
+        tb_set_render_thread(t);
+        double start = now_ns();
+        for (i = 0; i < n; i++) {
+            for (y = 0; y < bench_h; y++) {
+                for (x = 0; x < bench_w; x++) {
+                    int span = (x + y + i) / 4;
+                    tb_set_cell(x, y, 'a' + (x + i) % 26,
+                        (1 + span % 7) | attrs[span % 4], span % 3 ? 0 : 5);
+                }
+            }
+            double present_start = now_ns();
+            tb_present();
+            caller_ns += now_ns() - present_start;
+        }
+        tb_set_render_thread(0);
+        double total_ns = now_ns() - start;
+        tb_get_stats(&stats);
+        printf("thread %dx%d %-8s %10.0f ns/present %10.0f ns/frame total "
+               "merged=%zu\n",
+            bench_w, bench_h, t ? "threaded" : "inline", caller_ns / n,
+            total_ns / n, stats.frames_merged - merged);
+    }
+}
+
+/* Switches back and forth between two styled views, like tabs, redrawing
+ * each in full every frame, without and with the row cache. Reports time and
+ * bytes per frame, the hit rate and the memory the cache holds. */
+static void bench_row_cache(int n) {
+    static const int limits[] = {0, 4 << 20};
+    static const uintattr_t attrs[] = {0, TB_BOLD, TB_UNDERLINE, TB_BOLD};
+    struct tb_stats stats;
+    size_t m;
+    int i, x, y;
+
+    for (m = 0; m < sizeof(limits) / sizeof(limits[0]); m++) {
+        size_t bytes = 0, hits = 0, misses = 0;
+        double ns = 0;
+        tb_set_row_cache(limits[m]);
+        for (i = 0; i < n; i++) {
+            int view = i % 2;
+            for (y = 0; y < bench_h; y++) {
+                for (x = 0; x < bench_w; x++) {
+                    int span = (x + y * (view + 1)) / (view ? 6 : 4);
+                    tb_set_cell(x, y, 'a' + (x * (view + 1) + y) % 26,
+                        (1 + span % 7) | attrs[span % 4], span % 3 ? 0 : 5);
+                }
+            }
+            double start = now_ns();
+            tb_present();
+            ns += now_ns() - start;
+            tb_get_stats(&stats);
+            bytes += stats.bytes;
+            hits += stats.row_cache_hits;
+            misses += stats.row_cache_misses;
+        }
+        printf("row_cache %dx%d limit=%-7d %10.0f ns/frame %8.1f bytes/frame "
+               "%zu/%zu hits %zu bytes held\n",
+            bench_w, bench_h, limits[m], ns / n, (double)bytes / n, hits,
+            hits + misses, stats.row_cache_bytes);
+    }
+    tb_set_row_cache(0);
+}
+
+/* Styled frames estimated with tb_present_estimate() before each present.
+ * Reports the time of both and checks the estimate against the stats of the
+ * present that follows. */
+static void bench_estimate(int n) {
+    static const uintattr_t attrs[] = {0, TB_BOLD, TB_UNDERLINE, TB_BOLD};
+    struct tb_present_cost cost;
+    struct tb_stats stats;
+    double estimate_ns = 0, present_ns = 0;
+    size_t bytes = 0;
+    int i, x, y, mismatches = 0;
+
+    for (i = 0; i < n; i++) {
+        for (y = 0; y < bench_h; y++) {
+            for (x = 0; x < bench_w; x++) {
+                int span = (x + y + i) / 4;
+                tb_set_cell(x, y, 'a' + (x + i) % 26,
+                    (1 + span % 7) | attrs[span % 4], span % 3 ? 0 : 5);
+            }
+        }
+        double start = now_ns();
+        tb_present_estimate(&cost);
+        estimate_ns += now_ns() - start;
+        start = now_ns();
+        tb_present();
+        present_ns += now_ns() - start;
+        tb_get_stats(&stats);
+        bytes += stats.bytes;
+        if (cost.bytes != stats.bytes || cost.cells != stats.cells ||
+            cost.cursor_moves != stats.cursor_moves)
+        {
+            mismatches++;
+        }
+    }
+    printf("estimate %dx%d %10.0f ns/estimate %10.0f ns/present %8.1f "
+           "bytes/frame %d mismatches\n",
+        bench_w, bench_h, estimate_ns / n, present_ns / n, (double)bytes / n,
+        mismatches);
+}
+
+/* Immediate mode frames: the screen is cleared and drawn whole each frame,
+ * with most cells changing. Compares copying each sent cell into the front
+ * buffer with swapping the buffers under TB_PRESENT_REDRAW. */
+static void bench_redraw(int n) {
+    static const int modes[] = {TB_PRESENT_NORMAL, TB_PRESENT_REDRAW};
+    struct tb_stats stats;
+    size_t m;
+    int i, x, y;
+
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        size_t bytes = 0;
+        double ns = 0;
+        tb_set_present_mode(modes[m]);
+        for (i = 0; i < n; i++) {
+            tb_clear();
+            for (y = 0; y < bench_h; y++) {
+                for (x = 0; x < bench_w; x++) {
+                    tb_set_cell(x, y, 'a' + (x + y + i) % 26, 1 + (x + i) % 8,
+                        0);
+                }
+            }
+            double start = now_ns();
+            tb_present();
+            ns += now_ns() - start;
+            tb_get_stats(&stats);
+            bytes += stats.bytes;
+        }
+        printf("redraw %dx%d %-6s %10.0f ns/frame %8.1f bytes/frame\n",
+            bench_w, bench_h, m ? "swap" : "copy", ns / n, (double)bytes / n);
+    }
+    tb_set_present_mode(TB_PRESENT_NORMAL);
+}
+
+/* A chat pane full of emoji scrolling by a line each frame: skin tones, flags
+ * and ZWJ sequences, each a grapheme cluster of several code points, between
+ * plain words. Reports time and allocations per frame. */
+static void bench_clusters(int n) {
+    static uint32_t emoji[][7] = {
+        {0x1f44d, 0x1f3fd},
+        {0x1f1fa, 0x1f1f8},
+        {0x1f468, 0x200d, 0x1f469, 0x200d, 0x1f467, 0x200d, 0x1f466},
+        {0x2764, 0xfe0f},
+        {0x1f44b, 0x1f3fb},
+        {0x1f3f3, 0xfe0f, 0x200d, 0x1f308},
+    };
+    static const size_t nemoji[] = {2, 2, 7, 2, 2, 4};
+    double ns = 0;
+    size_t allocs = 0, bytes = 0;
+    struct tb_stats stats;
+    int i, x, y;
+
+    for (i = 0; i < n; i++) {
+        size_t allocs_start = bench_allocs;
+        double start = now_ns();
+        tb_clear();
+        for (y = 0; y < bench_h; y++) {
+            int line = y + i;
+            for (x = 0; x + 2 <= bench_w; x += 2) {
+                int k = (line * 7 + x / 2 * 3) % 9;
+                if (k < 6) {
+                    tb_set_cell_ex(x, y, emoji[k], nemoji[k], 0, 0);
+                } else {
+                    tb_set_cell(x, y, 'a' + (line + x) % 26, 0, 0);
+                    tb_set_cell(x + 1, y, ' ', 0, 0);
+                }
+            }
+        }
+        tb_present();
+        ns += now_ns() - start;
+        allocs += bench_allocs - allocs_start;
+        tb_get_stats(&stats);
+        bytes += stats.bytes;
+    }
+    printf("clusters %dx%d %10.0f ns/frame %10.1f allocs/frame %8.1f "
+           "bytes/frame\n",
+        bench_w, bench_h, ns / n, (double)allocs / n, (double)bytes / n);
+}
+
+/* A full-screen frame written a row at a time and cleared for the next one.
+ * With TB_OPT_SOA the rows are written through tb_cell_row(), otherwise with
+ * tb_set_cell(). Build with -DTB_OPT_SOA to compare the two layouts. */
+static void bench_rows(int n) {
+    double clear_ns = 0, fill_ns = 0, present_ns = 0;
+    int i, x, y;
+
+    for (i = 0; i < n; i++) {
+        double start = now_ns();
+        tb_clear();
+        double filled = now_ns();
+        clear_ns += filled - start;
+        for (y = 0; y < bench_h; y++) {
+#ifdef TB_OPT_SOA
+            uint32_t *ch;
+            uintattr_t *fg, *bg;
+            tb_cell_row(y, &ch, &fg, &bg);
+            for (x = 0; x < bench_w; x++) {
+                ch[x] = 'a' + (x * y) % 26;
+                fg[x] = 1 + x % 8;
+                bg[x] = 1 + y % 8;
+            }
+#else
+            for (x = 0; x < bench_w; x++) {
+                tb_set_cell(x, y, 'a' + (x * y) % 26, 1 + x % 8, 1 + y % 8);
+            }
+#endif
+        }
+        double presented = now_ns();
+        fill_ns += presented - filled;
+        tb_present();
+        present_ns += now_ns() - presented;
+    }
+    printf("rows %dx%d %-3s clear %8.0f ns fill %8.0f ns present %8.0f ns\n",
+        bench_w, bench_h,
+#ifdef TB_OPT_SOA
+        "soa",
+#else
+        "aos",
+#endif
+        clear_ns / n, fill_ns / n, present_ns / n);
+}
+
+/* The window edge dragged back and forth, resizing by a column and a row at a
+ * time around the given size, on a screen holding grapheme clusters. Reports
+ * time and allocations per resize, then the clusters still held once the
+ * screen is cleared, which should be none. */
+static void bench_resize(int n) {
+    static uint32_t thumbs[] = {0x1f44d, 0x1f3fd};
+    int w0 = bench_w, h0 = bench_h;
+    size_t allocs = 0;
+    double ns = 0;
+    int i, x, y;
+
+    for (y = 0; y < bench_h; y++) {
+        for (x = 0; x + 2 <= bench_w; x += 2) {
+            tb_set_cell_ex(x, y, thumbs, 2, 0, 0);
+        }
+    }
+    tb_present();
+    for (i = 0; i < n; i++) {
+        int d = i % 100 < 50 ? i % 50 : 50 - i % 50;
+        global.width = w0 - d;
+        global.height = h0 - d / 2;
+        size_t allocs_start = bench_allocs;
+        double start = now_ns();
+        resize_cellbufs();
+        ns += now_ns() - start;
+        allocs += bench_allocs - allocs_start;
+    }
+    tb_clear();
+    printf("resize %dx%d %10.0f ns/resize %6.2f allocs/resize", w0, h0, ns / n,
+        (double)allocs / n);
+#ifdef TB_OPT_EGC
+    printf(" %zu clusters held after clear", global.clusters.nused);
+#endif
+    printf("\n");
+}
+
+/* A full-screen panel built in the caller's memory and copied to the back
+ * buffer, cell by cell with tb_set_cell() and then with one tb_blit(). */
+static void bench_blit(int n) {
+    struct tb_cell *panel = calloc((size_t)bench_w * bench_h, sizeof(*panel));
+    double set_ns = 0, blit_ns = 0;
+    int i, x, y;
+
+    for (y = 0; y < bench_h; y++) {
+        for (x = 0; x < bench_w; x++) {
+            struct tb_cell *c = &panel[y * bench_w + x];
+            c->ch = 'a' + (x * y) % 26;
+            c->fg = 1 + x % 8;
+            c->bg = 1 + y % 8;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        double start = now_ns();
+        for (y = 0; y < bench_h; y++) {
+            for (x = 0; x < bench_w; x++) {
+                struct tb_cell *c = &panel[y * bench_w + x];
+                tb_set_cell(x, y, c->ch, c->fg, c->bg);
+            }
+        }
+        double set = now_ns();
+        tb_blit(0, 0, bench_w, bench_h, panel, bench_w);
+        blit_ns += now_ns() - set;
+        set_ns += set - start;
+    }
+    printf("blit %dx%d set_cell %10.0f ns/frame blit %10.0f ns/frame\n",
+        bench_w, bench_h, set_ns / n, blit_ns / n);
+    free(panel);
+}
+
+int main(int argc, char **argv) {
+    const char *name = argc > 1 ? argv[1] : "present_unchanged";
+    pid_t drain_pid;
+    int fd, rv;
+
+    setlocale(LC_ALL, "");
+    if (argc > 3) {
+        bench_w = atoi(argv[2]);
+        bench_h = atoi(argv[3]);
+    }
+
+    if ((fd = open_pty(&drain_pid)) < 0) {
+        fprintf(stderr, "open_pty failed\n");
+        return 1;
+    }
+    if ((rv = tb_init_fd(fd)) != TB_OK) {
+        fprintf(stderr, "tb_init_fd: %s\n", tb_strerror(rv));
+        return 1;
+    }
+
+    if (strcmp(name, "present_unchanged") == 0) {
+        bench_present_unchanged(2000);
+    } else if (strcmp(name, "motion") == 0) {
+        bench_motion(1000);
+    } else if (strcmp(name, "layout") == 0) {
+        bench_layout(1000);
+    } else if (strcmp(name, "styled") == 0) {
+        bench_styled(200);
+    } else if (strcmp(name, "flip") == 0) {
+        bench_flip(200);
+    } else if (strcmp(name, "flush") == 0) {
+        bench_flush(500);
+    } else if (strcmp(name, "paced") == 0) {
+        bench_paced(1000);
+    } else if (strcmp(name, "budget") == 0) {
+        bench_budget(200);
+    } else if (strcmp(name, "diff_threads") == 0) {
+        bench_diff_threads(500);
+    } else if (strcmp(name, "thread") == 0) {
+        bench_thread(500);
+    } else if (strcmp(name, "row_cache") == 0) {
+        bench_row_cache(500);
+    } else if (strcmp(name, "estimate") == 0) {
+        bench_estimate(200);
+    } else if (strcmp(name, "redraw") == 0) {
+        bench_redraw(200);
+    } else if (strcmp(name, "clusters") == 0) {
+        bench_clusters(200);
+    } else if (strcmp(name, "rows") == 0) {
+        bench_rows(500);
+    } else if (strcmp(name, "resize") == 0) {
+        bench_resize(1000);
+    } else if (strcmp(name, "blit") == 0) {
+        bench_blit(500);
+    } else {
+        tb_shutdown();
+        fprintf(stderr, "unknown case: %s\n", name);
+        return 1;
+    }
+
+    tb_shutdown();
+    close(fd);
+    waitpid(drain_pid, NULL, 0);
+    return 0;
+}
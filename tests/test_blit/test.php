@@ -0,0 +1,27 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+$h = $test->ffi->tb_height();
+
+// A 6x2 panel, clipped on the left, on the right and at the bottom
+$panel = $test->ffi->new('struct tb_cell[12]');
+foreach (['panel1', 'panel2'] as $y => $line) {
+    for ($x = 0; $x < 6; $x++) {
+        $panel[$y * 6 + $x]->ch = ord($line[$x]);
+    }
+}
+
+$rv_left = $test->ffi->tb_blit(-2, 0, 6, 2, $panel, 6);
+$rv_right = $test->ffi->tb_blit(76, 0, 6, 2, $panel, 6);
+$rv_bottom = $test->ffi->tb_blit(0, $h - 1, 6, 2, $panel, 6);
+$rv_off = $test->ffi->tb_blit(80, 0, 6, 2, $panel, 6);
+$rv_stride = $test->ffi->tb_blit(0, 0, 6, 2, $panel, 3);
+
+$test->ffi->tb_printf(0, 3, 0, 0, "rv=%d %d %d %d %d",
+    $rv_left, $rv_right, $rv_bottom, $rv_off, $rv_stride);
+
+$test->ffi->tb_present();
+
+$test->screencap();
@@ -0,0 +1,34 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+$ch = $test->ffi->new('uint32_t *');
+$fg = $test->ffi->new('uintattr_t *');
+$bg = $test->ffi->new('uintattr_t *');
+
+// Cells written straight to a row
+$rv = $test->ffi->tb_cell_row(0, FFI::addr($ch), FFI::addr($fg), FFI::addr($bg));
+if ($rv !== 0) {
+    // This will only work with TB_OPT_SOA
+    $test->skip();
+}
+foreach (str_split('row write') as $x => $c) {
+    $ch[$x] = ord($c);
+}
+
+// A cluster copied to another cell of its row and to the next row
+$test->ffi->tb_print(0, 1, 0, 0, "e\xcc\x81");
+$test->ffi->tb_cell_row(1, FFI::addr($ch), FFI::addr($fg), FFI::addr($bg));
+$cluster = $ch[0];
+$ch[4] = $cluster;
+$test->ffi->tb_cell_row(2, FFI::addr($ch), FFI::addr($fg), FFI::addr($bg));
+$ch[0] = $cluster;
+$test->ffi->tb_present();
+
+// The copies keep the cluster once the cell it was printed to is overwritten
+$test->ffi->tb_set_cell(0, 1, ord('x'), 0, 0);
+$test->ffi->tb_extend_cell(4, 1, 0x323);
+$test->ffi->tb_present();
+
+$test->screencap();
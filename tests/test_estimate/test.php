@@ -0,0 +1,48 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+$bold = $test->defines['TB_BOLD'];
+$underline = $test->defines['TB_UNDERLINE'];
+
+$cost = $test->ffi->new('struct tb_present_cost');
+$stats = $test->ffi->new('struct tb_stats');
+
+// The estimate of a styled frame matches what tb_present() then sends, whole
+// and over a budget that leaves rows for later
+$lines = [];
+foreach ([0, 100] as $budget) {
+    $test->ffi->tb_set_present_budget($budget);
+    for ($y = 0; $y < 12; $y++) {
+        $fg = (1 + ($y + $budget) % 8) | ($y % 3 == 0 ? $bold : 0) |
+            ($y % 4 == 1 ? $underline : 0);
+        $bg = 1 + ($y * 3) % 8;
+        $test->ffi->tb_print($y, $y, $fg, $bg, "styled row $y budget $budget");
+        $test->ffi->tb_print(40, $y, $bg, $fg & 0xff, "more");
+    }
+    $test->ffi->tb_present_estimate(FFI::addr($cost));
+    $test->ffi->tb_present();
+    $test->ffi->tb_get_stats(FFI::addr($stats));
+
+    $sgr = $stats->sgr_cache_hits + $stats->sgr_cache_misses;
+    $lines[] = sprintf(
+        'budget=%d bytes=%s cells=%s moves=%s sgr=%s rows_left=%s left_over=%s',
+        $budget,
+        $cost->bytes == $stats->bytes ? 'ok' : 'diff',
+        $cost->cells == $stats->cells ? 'ok' : 'diff',
+        $cost->cursor_moves == $stats->cursor_moves ? 'ok' : 'diff',
+        $cost->sgr_changes == $sgr ? 'ok' : 'diff',
+        $cost->rows_left == $stats->rows_left ? 'ok' : 'diff',
+        $stats->rows_left > 0 ? 'yes' : 'no'
+    );
+}
+
+$test->ffi->tb_set_present_budget(0);
+$test->ffi->tb_clear();
+foreach ($lines as $y => $line) {
+    $test->ffi->tb_print(0, $y, 0, 0, $line);
+}
+$test->ffi->tb_present();
+
+$test->screencap();
@@ -0,0 +1,28 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+$test->ffi->tb_set_max_fps(10);
+$fps = $test->ffi->tb_set_max_fps(-1);
+
+// The first frame is sent, the next two come too soon after it and are held
+// back, the second replacing the first
+for ($i = 1; $i <= 3; $i++) {
+    $test->ffi->tb_printf(0, 0, 0, 0, "frame %d", $i);
+    $test->ffi->tb_present();
+}
+
+// Waiting for an event sends the held-back frame once it's due
+$event = $test->ffi->new('struct tb_event');
+$test->ffi->tb_peek_event(FFI::addr($event), 500);
+$due = $test->ffi->tb_frame_due_ms();
+
+$stats = $test->ffi->new('struct tb_stats');
+$test->ffi->tb_get_stats(FFI::addr($stats));
+$test->ffi->tb_set_max_fps(0);
+$test->ffi->tb_printf(0, 1, 0, 0, "max_fps=%d merged=%d dropped=%d due=%d",
+    $fps, $stats->frames_merged, $stats->frames_dropped, $due);
+$test->ffi->tb_present();
+
+$test->screencap();
@@ -0,0 +1,17 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+$h = $test->ffi->tb_height();
+
+$test->ffi->tb_print(0, 0, 0, 0, 'left 1');
+$test->ffi->tb_print(40, 0, 0, 0, 'right 1');
+$test->ffi->tb_present();
+
+// Only the left pane is sent, the right one keeps showing the first frame
+$test->ffi->tb_print(0, 0, 0, 0, 'left 2');
+$test->ffi->tb_print(40, 0, 0, 0, 'right 2');
+$test->ffi->tb_present_region(0, 0, 40, $h);
+
+$test->screencap();
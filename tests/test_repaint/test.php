@@ -0,0 +1,27 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+$h = $test->ffi->tb_height();
+
+$test->ffi->tb_set_present_mode($test->defines['TB_PRESENT_REPAINT']);
+$mode = $test->ffi->tb_set_present_mode($test->defines['TB_PRESENT_CURRENT']);
+
+// Fill the screen, then flip to a mostly blank page, which is cheaper to send
+// by clearing the screen and drawing the page again
+for ($y = 0; $y < $h; $y++) {
+    $test->ffi->tb_printf(0, $y, 0, 0, "line %02d %s", $y, str_repeat('x', 60));
+}
+$test->ffi->tb_present();
+
+$test->ffi->tb_clear();
+$test->ffi->tb_print(0, 0, 0, 0, 'page 2');
+$test->ffi->tb_present();
+
+$stats = $test->ffi->new('struct tb_stats');
+$test->ffi->tb_get_stats(FFI::addr($stats));
+$test->ffi->tb_printf(0, 1, 0, 0, "present_mode=%d repainted=%d", $mode, $stats->repainted);
+$test->ffi->tb_present();
+
+$test->screencap();
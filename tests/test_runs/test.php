@@ -0,0 +1,18 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+// Fill three rows, then replace them with runs that can be sent as REP, EL
+// and ECH respectively
+$test->ffi->tb_print(0, 0, 0, 0, str_repeat('x', 70));
+$test->ffi->tb_print(0, 1, 0, 0, str_repeat('=', 70));
+$test->ffi->tb_print(0, 2, 0, 0, str_repeat('x', 60));
+$test->ffi->tb_present();
+
+$test->ffi->tb_print(0, 0, 0, 0, '+' . str_repeat('-', 60) . '+' . str_repeat(' ', 8));
+$test->ffi->tb_print(0, 1, 0, 0, str_repeat('=', 10) . str_repeat(' ', 60));
+$test->ffi->tb_print(5, 2, 0, 0, str_repeat(' ', 40));
+$test->ffi->tb_present();
+
+$test->screencap();
@@ -0,0 +1,20 @@
+<?php
+declare(strict_types=1);
+
+$test->ffi->tb_init();
+
+$h = $test->ffi->tb_height();
+
+$test->ffi->tb_set_present_mode($test->defines['TB_PRESENT_SCROLL']);
+$mode = $test->ffi->tb_set_present_mode($test->defines['TB_PRESENT_CURRENT']);
+
+// Scroll a pane of h-1 rows up by 3, then down by 1
+foreach ([0, 3, 2] as $offset) {
+    for ($y = 0; $y < $h - 1; $y++) {
+        $test->ffi->tb_printf(0, $y, 0, 0, "line %02d", $y + $offset);
+    }
+    $test->ffi->tb_printf(0, $h - 1, 0, 0, "present_mode=%d", $mode);
+    $test->ffi->tb_present();
+}
+
+$test->screencap();